@@ -1,7 +1,10 @@
 package cgotraceback
 
 import (
+	"fmt"
+	"runtime"
 	"testing"
+	"time"
 
 	"github.com/nsrip-dd/cgotraceback/internal"
 )
@@ -20,4 +23,49 @@ func BenchmarkContext(b *testing.B) {
 			internal.DoCallback(func() {})
 		}
 	})
+
+	b.Run("while-profiling/idle", func(b *testing.B) {
+		SetCaptureWhileProfiling(true)
+		defer SetCaptureWhileProfiling(false)
+		for i := 0; i < b.N; i++ {
+			internal.DoCallback(func() {})
+		}
+	})
+
+	// Every callback collects its call stack, so the C part of each
+	// context is unwound
+	for _, reuse := range []bool{true, false} {
+		b.Run(fmt.Sprintf("callers/reuse=%v", reuse), func(b *testing.B) {
+			setCallSiteReuse(reuse)
+			defer setCallSiteReuse(true)
+			var pcs [64]uintptr
+			for i := 0; i < b.N; i++ {
+				internal.DoCallback(func() {
+					runtime.Callers(0, pcs[:])
+				})
+			}
+		})
+	}
+
+	// Each level is a C->Go->C transition, holding a context until the
+	// levels below it return
+	for _, depth := range []int{8, 64, 512} {
+		b.Run(fmt.Sprintf("nested/depth=%d", depth), func(b *testing.B) {
+			start := time.Now()
+			for i := 0; i < b.N; i++ {
+				nestCallbacks(depth)
+			}
+			elapsed := time.Since(start)
+			b.ReportMetric(float64(elapsed.Nanoseconds())/float64(b.N*depth), "ns/transition")
+		})
+	}
+}
+
+func nestCallbacks(depth int) {
+	if depth == 0 {
+		return
+	}
+	internal.DoCallback(func() {
+		nestCallbacks(depth - 1)
+	})
 }
@@ -25,10 +25,15 @@
 //		yum install elfutils-libs
 //
 // To use libdwfl, provide the "use_libdwfl" build tag.
+//
+// The unwinder and symbolizer parse the loaded libraries when the program
+// starts. To do this in a background thread instead, provide the
+// "use_background_init" build tag and use Ready to check whether it's done.
 package cgotraceback
 
 import (
 	"runtime"
+	"time"
 	"unsafe"
 
 	asyncprofiler "github.com/nsrip-dd/cgotraceback/internal/async-profiler"
@@ -39,6 +44,7 @@ import (
 #cgo CXXFLAGS: -g -O2
 #cgo linux LDFLAGS: -ldl
 #cgo use_libdwfl LDFLAGS: -ldw
+#cgo use_background_init CFLAGS: -DCGOTRACEBACK_BACKGROUND_INIT
 extern void cgo_symbolizer(void *);
 */
 import "C"
@@ -51,7 +57,161 @@ func init() {
 	)
 }
 
+// Ready reports whether the C call stack unwinder has finished initializing.
+// Initialization normally happens before the program starts. If the program
+// is built with the "use_background_init" tag, it instead happens in a
+// background thread, and until it's done C call stacks are collected using
+// only frame pointers.
+func Ready() bool {
+	return asyncprofiler.Ready()
+}
+
+// Unwinder is a way of unwinding C call stacks
+type Unwinder = asyncprofiler.Unwinder
+
+const (
+	// UnwinderDWARF uses the DWARF unwind tables of every library, and
+	// frame pointers where there are none. This is the default.
+	UnwinderDWARF = asyncprofiler.UnwinderDWARF
+	// UnwinderFramePointer only follows frame pointers. It's the cheapest,
+	// but loses the caller of every function built without frame pointers.
+	UnwinderFramePointer = asyncprofiler.UnwinderFramePointer
+	// UnwinderGCC uses libgcc's _Unwind_Backtrace. It can only unwind from
+	// the function calling it, so C->Go calls unwind their C call stack up
+	// front, and CPU profile samples in C code use frame pointers instead.
+	UnwinderGCC = asyncprofiler.UnwinderGCC
+)
+
+// SetUnwinder selects the unwinder for C call stacks, normally in an init
+// function. It returns false, and leaves the unwinder as it was, if the
+// unwinder isn't supported.
+func SetUnwinder(u Unwinder) bool {
+	return asyncprofiler.SetUnwinder(u)
+}
+
+// SetMaxDepth sets the largest number of C frames collected for a call stack.
+// It is 32 by default and at most 1024. The Go runtime takes at most 32 C
+// frames for each part of a traceback or profile sample, so larger settings
+// only deepen the call stacks of stack snapshots.
+func SetMaxDepth(depth int) {
+	asyncprofiler.SetMaxDepth(depth)
+}
+
+// SetCaptureWhileProfiling controls whether the C call stack context is saved
+// on every call from C to Go, or only while a profiler is running. Saving the
+// context has a small cost on every call, which this mode avoids for
+// programs that profile only part of the time. Stacks for calls which started
+// before profiling did lack their C frames.
+//
+// A profiler is running while the runtime CPU profiler is on, or between
+// calls to ProfilerStarted and ProfilerStopped. Profiling is checked every
+// so many calls on each thread, and at each CPU profile sample in C code.
+func SetCaptureWhileProfiling(status bool) {
+	asyncprofiler.SetCaptureWhileProfiling(status)
+}
+
+// ProfilerStarted marks the start of a profile which collects C call stacks
+// through the runtime traceback functions, other than the runtime CPU
+// profiler, for use with SetCaptureWhileProfiling. Calls nest, and each must
+// be matched by a call to ProfilerStopped.
+func ProfilerStarted() {
+	asyncprofiler.ProfilerStarted()
+}
+
+// ProfilerStopped marks the end of a profile started with ProfilerStarted
+func ProfilerStopped() {
+	asyncprofiler.ProfilerStopped()
+}
+
+// EnableStackSnapshots makes CPU profile samples in C code take a snapshot of
+// the registers and the top window bytes of the stack, like perf's DWARF call
+// graphs, rather than unwinding the C call stack in the signal handler. A
+// background thread unwinds the snapshots, and ReadStackSnapshots returns
+// their call stacks. The samples in the runtime CPU profile only get the C
+// function which was interrupted.
+//
+// This bounds the time spent in the signal handler by the copy, rather than by
+// the depth of the call stack and the cost of finding its unwind information,
+// at the cost of copying window bytes per sample, most of which is never read.
+// Call stacks deeper than the window are cut short. The window is fixed by the
+// first call, and is 8192 bytes if it's 0. It returns false if snapshots
+// aren't supported, which is only on Linux.
+func EnableStackSnapshots(window int) bool {
+	return asyncprofiler.EnableStackSnapshots(window)
+}
+
+// DisableStackSnapshots goes back to unwinding C call stacks in the signal
+// handler. Snapshots already taken can still be read.
+func DisableStackSnapshots() {
+	asyncprofiler.DisableStackSnapshots()
+}
+
+// StackSnapshot is the C call stack of a CPU profile sample taken with
+// EnableStackSnapshots.
+//
+// The sample itself only gets the interrupted C function, which is PCs[0].
+// The runtime CPU profile aggregates its samples, so a snapshot matches the
+// samples whose C part is PCs[0], and TID and Time tell which of them it
+// was, for profilers which record when and on which thread each sample was
+// taken.
+type StackSnapshot struct {
+	PCs []uintptr
+	// TID is the operating system thread which was interrupted
+	TID int
+	// Time is when the sample was taken. It has a monotonic clock reading,
+	// so it can be compared with times from time.Now.
+	Time time.Time
+}
+
+// ReadStackSnapshots calls fn with each snapshot unwound so far, and returns
+// how many there were. The PCs slice is only valid during the call. Each CPU
+// holds a limited number of snapshots until they're read, and samples
+// without room for a snapshot are lost, so snapshots should be read
+// regularly while profiling.
+func ReadStackSnapshots(fn func(s StackSnapshot)) int {
+	var pcs [1024]uintptr
+	// Snapshot times are converted by their distance from now
+	now, monotonicNow := time.Now(), asyncprofiler.MonotonicTime()
+	count := 0
+	for {
+		n, sample, ok := asyncprofiler.ReadStackSnapshot(pcs[:])
+		if !ok {
+			return count
+		}
+		fn(StackSnapshot{
+			PCs:  pcs[:n],
+			TID:  sample.TID,
+			Time: now.Add(time.Duration(int64(sample.Time - monotonicNow))),
+		})
+		count++
+	}
+}
+
 // for testing
 func setEnabled(status bool) {
 	asyncprofiler.SetEnabled(status)
 }
+
+// for testing
+func setCallSiteReuse(status bool) {
+	asyncprofiler.SetCallSiteReuse(status)
+}
+
+// for testing: returns how many stack reads by the unwinder weren't within the
+// reading thread's cached stack bounds, and how many of those faulted
+func stackReadFallbacks() (fallback, faults uint64) {
+	stats := asyncprofiler.GetStackReadStats()
+	return stats.Fallback, stats.Faults
+}
+
+// for testing: reports whether the calling thread's stack bounds are cached
+func threadStackBoundsCached() bool {
+	return asyncprofiler.ThreadStackBoundsCached()
+}
+
+// for testing: returns how many C->Go call contexts the calling thread has in
+// use, and how many it has altogether
+func contextsInUse() (inUse, total int) {
+	total, free, kept := asyncprofiler.ContextPoolStats()
+	return total - free - kept, total
+}
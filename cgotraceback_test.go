@@ -5,17 +5,31 @@
 package cgotraceback_test
 
 import (
+	"bytes"
+	"compress/gzip"
+	"encoding/binary"
+	"errors"
 	"io"
+	"os"
 	"reflect"
 	"runtime"
 	"runtime/pprof"
 	"testing"
 	"time"
 
-	_ "github.com/nsrip-dd/cgotraceback"
+	"github.com/nsrip-dd/cgotraceback"
 	"github.com/nsrip-dd/cgotraceback/internal"
 )
 
+func TestMain(m *testing.M) {
+	// With the use_background_init tag, the unwinder might not be ready yet
+	deadline := time.Now().Add(10 * time.Second)
+	for !cgotraceback.Ready() && time.Now().Before(deadline) {
+		time.Sleep(time.Millisecond)
+	}
+	os.Exit(m.Run())
+}
+
 func TestCgoTraceback(t *testing.T) {
 	var pcs []uintptr
 	internal.DoCallback(func() {
@@ -105,3 +119,314 @@ func TestNoDeadlock(t *testing.T) {
 	}
 	_ = pcs
 }
+
+// A context keeps every C frame the runtime takes for a traceback, and they
+// must come back intact whether the context is unwound or cached
+func TestDeepCStack(t *testing.T) {
+	// The runtime takes at most 32 C frames per context
+	const depth = 24
+	cgotraceback.SetMaxDepth(64)
+	defer cgotraceback.SetMaxDepth(32)
+
+	// Each recursive call returns to the same place, and the functions may
+	// not have symbols, so count the longest run of the same pc
+	countRecursive := func() int {
+		var pcs [256]uintptr
+		n := runtime.Callers(0, pcs[:])
+		longest, run := 0, 0
+		for i := 0; i < n; i++ {
+			if i > 0 && pcs[i] == pcs[i-1] {
+				run++
+			} else {
+				run = 1
+			}
+			if run > longest {
+				longest = run
+			}
+		}
+		return longest
+	}
+	for i := 0; i < 3; i++ {
+		var counts [2]int
+		internal.DoCallbackDepth(depth, func() {
+			for j := range counts {
+				counts[j] = countRecursive()
+			}
+		})
+		for j, count := range counts {
+			if count != depth {
+				t.Errorf("call %d, unwind %d: got %d recursive C frames, want %d", i, j, count, depth)
+			}
+		}
+	}
+}
+
+func callbackHasCFrame() bool {
+	var found bool
+	internal.DoCallback(func() { found = internal.HasCFrame() })
+	return found
+}
+
+// Threads only check for profilers every so many C->Go calls, so this makes
+// enough for the calling thread to have checked
+func checkProfiling() {
+	for i := 0; i < 2048; i++ {
+		internal.DoCallback(func() {})
+	}
+}
+
+func TestCaptureWhileProfiling(t *testing.T) {
+	// The checks are counted per thread
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	cgotraceback.SetCaptureWhileProfiling(true)
+	defer cgotraceback.SetCaptureWhileProfiling(false)
+	if callbackHasCFrame() {
+		t.Fatal("context captured without a profiler running")
+	}
+
+	t.Run("ProfilerStarted", func(t *testing.T) {
+		cgotraceback.ProfilerStarted()
+		if !callbackHasCFrame() {
+			t.Error("context not captured after ProfilerStarted")
+		}
+		// A context captured before the profiler stops is still unwound
+		// after capture is turned off
+		internal.DoCallback(func() {
+			cgotraceback.ProfilerStopped()
+			checkProfiling()
+			if !internal.HasCFrame() {
+				t.Error("context captured before ProfilerStopped lost its C frames")
+			}
+		})
+		checkProfiling()
+		if callbackHasCFrame() {
+			t.Error("context captured after ProfilerStopped")
+		}
+	})
+
+	t.Run("StartCPUProfile", func(t *testing.T) {
+		if err := pprof.StartCPUProfile(io.Discard); err != nil {
+			t.Skipf("CPU profile already running: %v", err)
+		}
+		checkProfiling()
+		if !callbackHasCFrame() {
+			pprof.StopCPUProfile()
+			t.Fatal("context not captured during a CPU profile")
+		}
+		internal.DoCallback(func() {
+			pprof.StopCPUProfile()
+			checkProfiling()
+			if !internal.HasCFrame() {
+				t.Error("context captured before StopCPUProfile lost its C frames")
+			}
+		})
+		checkProfiling()
+		if callbackHasCFrame() {
+			t.Error("context captured after StopCPUProfile")
+		}
+	})
+}
+
+func TestUnwinders(t *testing.T) {
+	unwinders := []struct {
+		name string
+		u    cgotraceback.Unwinder
+	}{
+		{"fp", cgotraceback.UnwinderFramePointer},
+		{"gcc", cgotraceback.UnwinderGCC},
+		{"dwarf", cgotraceback.UnwinderDWARF},
+	}
+	// The default goes last, so it's back in place afterwards
+	defer cgotraceback.SetUnwinder(cgotraceback.UnwinderDWARF)
+	for _, u := range unwinders {
+		t.Run(u.name, func(t *testing.T) {
+			if !cgotraceback.SetUnwinder(u.u) {
+				t.Fatal("unwinder not supported")
+			}
+			// The C code is built with frame pointers, so every unwinder
+			// finds both C callers
+			var found1, found2 bool
+			internal.DoCallback(func() {
+				internal.DoCallback2(func() {
+					var pcs [128]uintptr
+					n := runtime.Callers(0, pcs[:])
+					frames := runtime.CallersFrames(pcs[:n])
+					for {
+						frame, more := frames.Next()
+						found1 = found1 || frame.Function == internal.CFuncName
+						found2 = found2 || frame.Function == internal.CFuncName2
+						if !more {
+							break
+						}
+					}
+				})
+			})
+			if !found1 || !found2 {
+				t.Errorf("C callers missing: %s found=%v, %s found=%v",
+					internal.CFuncName, found1, internal.CFuncName2, found2)
+			}
+
+			// Profiling signals in C code walk with the unwinder too
+			const depth = 12
+			var buf bytes.Buffer
+			if err := pprof.StartCPUProfile(&buf); err != nil {
+				t.Skipf("CPU profile already running: %v", err)
+			}
+			start := time.Now()
+			for time.Since(start) < 500*time.Millisecond {
+				internal.SpinC(depth, 1<<20)
+			}
+			pprof.StopCPUProfile()
+			stacks, err := profileStacks(buf.Bytes())
+			if err != nil {
+				t.Fatal(err)
+			}
+			var samples, full int64
+			spin := uint64(internal.SpinCAddress())
+			for _, sample := range stacks {
+				stack := sample.addrs
+				if len(stack) == 0 || stack[0] < spin || stack[0] >= spin+1024 {
+					continue
+				}
+				samples += sample.count
+				// Each recursive call returns to the same place
+				frames := 1
+				for frames < len(stack)-1 && stack[frames+1] == stack[1] {
+					frames++
+				}
+				if frames == depth {
+					full += sample.count
+				}
+			}
+			t.Logf("%d samples in SpinC, %d with every recursive frame", samples, full)
+			if samples == 0 {
+				t.Fatal("no samples in SpinC")
+			}
+			// SpinC spends almost all its time in the loop at the bottom
+			if full < samples*9/10 {
+				t.Errorf("only %d of %d samples in SpinC had every recursive frame", full, samples)
+			}
+		})
+	}
+}
+
+type profileSample struct {
+	// The first value, which is the number of samples in a CPU profile
+	count int64
+	// The address of each location, leaf first
+	addrs []uint64
+}
+
+// profileStacks decodes a gzipped pprof profile just enough to return its
+// samples
+func profileStacks(data []byte) ([]profileSample, error) {
+	r, err := gzip.NewReader(bytes.NewReader(data))
+	if err != nil {
+		return nil, err
+	}
+	data, err = io.ReadAll(r)
+	if err != nil {
+		return nil, err
+	}
+	var samples []profileSample
+	addrs := make(map[uint64]uint64)
+	err = protoFields(data, func(field int, v uint64, msg []byte) error {
+		switch field {
+		case 2: // Profile.sample
+			var ids, values []uint64
+			err := protoFields(msg, func(field int, v uint64, packed []byte) error {
+				switch field {
+				case 1: // Sample.location_id
+					return appendVarints(&ids, v, packed)
+				case 2: // Sample.value
+					return appendVarints(&values, v, packed)
+				}
+				return nil
+			})
+			if len(values) == 0 {
+				return errors.New("sample without values")
+			}
+			samples = append(samples, profileSample{count: int64(values[0]), addrs: ids})
+			return err
+		case 4: // Profile.location
+			var id, addr uint64
+			err := protoFields(msg, func(field int, v uint64, _ []byte) error {
+				switch field {
+				case 1: // Location.id
+					id = v
+				case 3: // Location.address
+					addr = v
+				}
+				return nil
+			})
+			addrs[id] = addr
+			return err
+		}
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	for _, sample := range samples {
+		for i, id := range sample.addrs {
+			sample.addrs[i] = addrs[id]
+		}
+	}
+	return samples, nil
+}
+
+// appendVarints appends a repeated varint field to values, which is either
+// the single value v, or packed
+func appendVarints(values *[]uint64, v uint64, packed []byte) error {
+	if packed == nil {
+		*values = append(*values, v)
+		return nil
+	}
+	for len(packed) > 0 {
+		v, n := binary.Uvarint(packed)
+		if n <= 0 {
+			return errors.New("bad packed varint")
+		}
+		*values = append(*values, v)
+		packed = packed[n:]
+	}
+	return nil
+}
+
+// protoFields calls f with each field of a protobuf message, with the value
+// of varints, and the bytes of length-delimited fields
+func protoFields(data []byte, f func(field int, v uint64, b []byte) error) error {
+	for len(data) > 0 {
+		key, n := binary.Uvarint(data)
+		if n <= 0 {
+			return errors.New("bad field key")
+		}
+		data = data[n:]
+		field := int(key >> 3)
+		switch key & 7 {
+		case 0:
+			v, n := binary.Uvarint(data)
+			if n <= 0 {
+				return errors.New("bad varint")
+			}
+			data = data[n:]
+			if err := f(field, v, nil); err != nil {
+				return err
+			}
+		case 2:
+			l, n := binary.Uvarint(data)
+			if n <= 0 || uint64(len(data)-n) < l {
+				return errors.New("bad length")
+			}
+			if err := f(field, 0, data[n:n+int(l)]); err != nil {
+				return err
+			}
+			data = data[n+int(l):]
+		default:
+			return errors.New("unexpected wire type")
+		}
+	}
+	return nil
+}
@@ -0,0 +1,53 @@
+//go:build cgo && (linux || darwin)
+// +build cgo
+// +build linux darwin
+
+package cgotraceback
+
+import (
+	"runtime"
+	"testing"
+
+	"github.com/nsrip-dd/cgotraceback/internal"
+)
+
+// Each level of nesting holds a context until the levels below it return,
+// so nesting deeper than the 256 contexts a thread used to be limited to
+// makes its pool grow
+func TestNestedContexts(t *testing.T) {
+	const depth = 300
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	var missing, peak int
+	var nest func(level int)
+	nest = func(level int) {
+		if !internal.HasCFrame() {
+			missing++
+		}
+		if inUse, _ := contextsInUse(); inUse > peak {
+			peak = inUse
+		}
+		if level < depth {
+			internal.DoCallback(func() { nest(level + 1) })
+		}
+	}
+	internal.DoCallback(func() { nest(1) })
+
+	if missing > 0 {
+		t.Errorf("%d of %d nested calls lacked their C frames", missing, depth)
+	}
+	if peak != depth {
+		t.Errorf("%d contexts were in use at the deepest level, want %d", peak, depth)
+	}
+	inUse, total := contextsInUse()
+	if inUse != 0 {
+		t.Errorf("%d of %d contexts still in use after the calls returned", inUse, total)
+	}
+
+	// The contexts are reused rather than the pool growing again
+	internal.DoCallback(func() { nest(1) })
+	if inUse, again := contextsInUse(); inUse != 0 || again != total {
+		t.Errorf("after nesting again, %d of %d contexts in use, want 0 of %d", inUse, again, total)
+	}
+}
@@ -53,6 +53,14 @@ const int PLT_HEADER_SIZE = 16;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 8;  // PERF_REG_X86_IP
 
+// The bytes below the stack pointer which a function may use without moving
+// it, and which signal handlers leave alone
+#ifdef __x86_64__
+const int RED_ZONE_SIZE = 128;
+#else
+const int RED_ZONE_SIZE = 0;
+#endif
+
 #define spinPause()       asm volatile("pause")
 #define rmb()             asm volatile("lfence" : : : "memory")
 #define flushCache(addr)  asm volatile("mfence; clflush (%0); mfence" : : "r" (addr) : "memory")
@@ -70,6 +78,7 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 20;
 const int PLT_ENTRY_SIZE = 12;
 const int PERF_REG_PC = 15;  // PERF_REG_ARM_PC
+const int RED_ZONE_SIZE = 0;
 
 #define spinPause()       asm volatile("yield")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -87,6 +96,7 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 32;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 32;  // PERF_REG_ARM64_PC
+const int RED_ZONE_SIZE = 0;
 
 #define spinPause()       asm volatile("isb")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -106,6 +116,7 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 24;
 const int PLT_ENTRY_SIZE = 24;
 const int PERF_REG_PC = 32;  // PERF_REG_POWERPC_NIP
+const int RED_ZONE_SIZE = 288;
 
 #define spinPause()       asm volatile("yield") // does nothing, but using or 1,1,1 would lead to other problems
 #define rmb()             asm volatile ("sync" : : : "memory") // lwsync would do but better safe than sorry
@@ -0,0 +1,703 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "codeCache.h"
+#include "dwarf.h"
+#include "fdeCache.h"
+#include "persistentCache.h"
+#include "stackSnapshot.h"
+#include "stackWalker.h"
+#include "symbols.h"
+#include "unwinder.h"
+#include "unwindTable.h"
+
+// Helpers for the Go benchmarks and tests in this package. They run their
+// loops in C++ so that the cgo call overhead doesn't swamp the cost being
+// measured. Some change global state, such as the cache directory, so they're
+// only built with the "cgotraceback_bench" build tag, which the package's
+// tests and benchmarks need.
+
+static const uintptr_t BENCH_LIB_BASE = 0x10000000;
+static const uintptr_t BENCH_LIB_SIZE = 0x100000;
+
+struct bench_libraries {
+    CodeCacheArray array;
+    CodeCache** libs;
+    int count;
+};
+
+static inline uint64_t xorshift(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Returns an address in a random library, or in the gap after it
+static inline const void* bench_address(uint64_t &state, int count) {
+    uint64_t r = xorshift(state);
+    uintptr_t lib = (r >> 32) % count;
+    uintptr_t off = r & (2 * BENCH_LIB_SIZE - 1);
+    return (const void*)(BENCH_LIB_BASE + lib * 2 * BENCH_LIB_SIZE + off);
+}
+
+void populateStackContext(StackContext &sc, void *ucontext);
+CodeCacheArray *unwinderLibraries();
+
+// Recurses depth times and then unwinds the stack iterations times
+static __attribute__((noinline)) uintptr_t bench_walk(int depth, int iterations) {
+    if (depth > 0) {
+        uintptr_t frames = bench_walk(depth - 1, iterations);
+        // Prevent the recursive call from becoming a tail call
+        __asm__ volatile("" : : : "memory");
+        return frames;
+    }
+
+    const int max_depth = 256;
+    uintptr_t callchain[max_depth];
+    cacheThreadStackBounds();
+    CodeCacheArray *cache = unwinderLibraries();
+    uintptr_t frames = 0;
+    for (int i = 0; i < iterations; i++) {
+        StackContext sc;
+        populateStackContext(sc, NULL);
+        frames += stackWalk(cache, sc, callchain, max_depth, 0);
+    }
+    return frames;
+}
+
+// Recurses depth more times and then does one memoized walk of up to
+// max_depth frames
+static __attribute__((noinline)) uintptr_t bench_walk_memo_sample(int depth, int max_depth) {
+    if (depth > 0) {
+        uintptr_t frames = bench_walk_memo_sample(depth - 1, max_depth);
+        __asm__ volatile("" : : : "memory");
+        return frames;
+    }
+
+    uintptr_t callchain[max_depth];
+    StackContext sc;
+    populateStackContext(sc, NULL);
+    return stackWalkMemo(unwinderLibraries(), sc, callchain, max_depth);
+}
+
+// Recurses depth times and then takes iterations samples, each from a
+// slightly different depth below that, like a profiler sampling a thread
+// busy in a deep computation
+static __attribute__((noinline)) uintptr_t bench_walk_memo(int depth, int iterations, int max_depth) {
+    if (depth > 0) {
+        uintptr_t frames = bench_walk_memo(depth - 1, iterations, max_depth);
+        __asm__ volatile("" : : : "memory");
+        return frames;
+    }
+
+    uintptr_t frames = 0;
+    cacheThreadStackBounds();
+    for (int i = 0; i < iterations; i++) {
+        frames += bench_walk_memo_sample(i & 3, max_depth);
+    }
+    return frames;
+}
+
+// Walks the stack from here with stackWalkMemo and stackWalk, and returns
+// whether they found the same frames
+static __attribute__((noinline)) bool bench_memo_matches(int max_depth) {
+    uintptr_t memo[max_depth];
+    uintptr_t plain[max_depth];
+    StackContext sc;
+    populateStackContext(sc, NULL);
+    StackContext copy = sc;
+    CodeCacheArray *cache = unwinderLibraries();
+    int memo_depth = stackWalkMemo(cache, sc, memo, max_depth);
+    int plain_depth = stackWalk(cache, copy, plain, max_depth, 0);
+    return memo_depth == plain_depth && memo_depth > 0 && memcmp(memo, plain, memo_depth * sizeof(uintptr_t)) == 0;
+}
+
+static __attribute__((noinline)) bool bench_memo_path_b(int depth, int path, int max_depth);
+
+// Recurses depth more times, through whichever of two functions each bit of
+// path picks, so that samples at the same depth have different call stacks,
+// and then compares the walks
+static __attribute__((noinline)) bool bench_memo_path_a(int depth, int path, int max_depth) {
+    bool matches;
+    if (depth == 0) {
+        matches = bench_memo_matches(max_depth);
+    } else if (path & 1) {
+        matches = bench_memo_path_b(depth - 1, path >> 1, max_depth);
+    } else {
+        matches = bench_memo_path_a(depth - 1, path >> 1, max_depth);
+    }
+    __asm__ volatile("" : : : "memory");
+    return matches;
+}
+
+// Like bench_memo_path_a, but with a bigger frame
+static __attribute__((noinline)) bool bench_memo_path_b(int depth, int path, int max_depth) {
+    volatile char pad[32];
+    pad[0] = 0;
+    bool matches = bench_memo_path_a(depth, path, max_depth);
+    __asm__ volatile("" : : : "memory");
+    return matches && pad[0] == 0;
+}
+
+// Takes iterations samples, each through a different mix of paths and from
+// between 0 and 7 frames further down, and counts those where stackWalkMemo
+// disagreed with stackWalk
+static __attribute__((noinline)) int bench_memo_check(int depth, int iterations, int max_depth) {
+    if (depth > 0) {
+        int mismatches = bench_memo_check(depth - 1, iterations, max_depth);
+        __asm__ volatile("" : : : "memory");
+        return mismatches;
+    }
+
+    cacheThreadStackBounds();
+    int mismatches = 0;
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < iterations; i++) {
+        uint64_t r = xorshift(state);
+        // Mostly repeat the last sample's path, as a profiler would see
+        int path = (r >> 8) & 3 ? (i / 16) & 0x7f : (r >> 16) & 0x7f;
+        mismatches += !bench_memo_path_a(r & 7, path, max_depth);
+    }
+    return mismatches;
+}
+
+// Unwinds the stack from its caller iterations times with the given engine.
+// The caller's frame stays put meanwhile, as a C->Go call's does while its
+// context is saved, so every engine can start from it.
+static __attribute__((noinline)) uintptr_t bench_walk_engine_from_caller(int engine, int iterations) {
+    const int max_depth = 256;
+    uintptr_t callchain[max_depth];
+    CodeCacheArray *cache = unwinderLibraries();
+    cacheThreadStackBounds();
+    StackContext caller;
+    populateStackContext(caller, NULL);
+    skipFrames(caller, cache, 1);
+    uintptr_t frames = 0;
+    for (int i = 0; i < iterations; i++) {
+        StackContext sc = caller;
+        frames += Unwinder::walk((UnwindEngine)engine, cache, sc, true, callchain, max_depth);
+    }
+    return frames;
+}
+
+// Recurses depth times and then unwinds the stack iterations times with the
+// given engine
+static __attribute__((noinline)) uintptr_t bench_walk_engine(int engine, int depth, int iterations) {
+    uintptr_t frames;
+    if (depth > 0) {
+        frames = bench_walk_engine(engine, depth - 1, iterations);
+    } else {
+        frames = bench_walk_engine_from_caller(engine, iterations);
+    }
+    // Prevent the calls from becoming tail calls
+    __asm__ volatile("" : : : "memory");
+    return frames;
+}
+
+static uint64_t bench_nanotime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Captures iterations snapshots of the stack, with window bytes each, and
+// unwinds them in batches, as the UnwindWorker would. The time spent on each
+// side is added to capture_ns and unwind_ns, and the bytes of stack copied
+// are stored in bytes.
+static __attribute__((noinline)) uintptr_t bench_snapshot_batches(int window, int iterations, uint64_t *capture_ns,
+                                                                  uint64_t *unwind_ns, uint64_t *bytes) {
+    const int batch = SNAPSHOTS_PER_CPU / 2;
+    // Off the stack, so that the window starts close to the frames
+    const int max_depth = 256;
+    std::vector<uintptr_t> callchain(max_depth);
+    CodeCacheArray *cache = unwinderLibraries();
+    cacheThreadStackBounds();
+    SnapshotBuffer buffer;
+    if (!buffer.init(window)) {
+        return 0;
+    }
+    uintptr_t frames = 0;
+    for (int i = 0; i < iterations; i += batch) {
+        int n = iterations - i < batch ? iterations - i : batch;
+        uint64_t start = bench_nanotime();
+        for (int j = 0; j < n; j++) {
+            StackContext sc;
+            populateStackContext(sc, NULL);
+            buffer.capture(sc);
+        }
+        uint64_t captured = bench_nanotime();
+        buffer.unwindPending(cache, max_depth);
+        *unwind_ns += bench_nanotime() - captured;
+        *capture_ns += captured - start;
+        int depth;
+        while ((depth = buffer.read(callchain.data(), max_depth)) >= 0) {
+            frames += depth;
+        }
+    }
+    StackSnapshotStats stats;
+    buffer.stats(stats);
+    *bytes = stats.bytes;
+    return frames;
+}
+
+// Recurses depth times and then benchmarks snapshots of the stack
+static __attribute__((noinline)) uintptr_t bench_snapshot(int depth, int window, int iterations, uint64_t *capture_ns,
+                                                          uint64_t *unwind_ns, uint64_t *bytes) {
+    uintptr_t frames;
+    if (depth > 0) {
+        frames = bench_snapshot(depth - 1, window, iterations, capture_ns, unwind_ns, bytes);
+    } else {
+        frames = bench_snapshot_batches(window, iterations, capture_ns, unwind_ns, bytes);
+    }
+    // Prevent the calls from becoming tail calls
+    __asm__ volatile("" : : : "memory");
+    return frames;
+}
+
+// Unwind tables for every loaded library, in both the flat FrameDesc form
+// produced by DwarfParser and the compact UnwindTable form
+struct bench_unwind_tables {
+    std::vector<FrameDesc*> flat;
+    std::vector<int> flat_count;
+    std::vector<UnwindTable*> compact;
+    std::vector<const char*> text_base;
+    std::vector<const char*> eh_frame_hdr;
+    std::vector<uint64_t> load_id;
+    int rows;
+};
+
+// The FrameDesc lookup used before UnwindTable
+static FrameDesc* bench_flat_find(FrameDesc* table, int length, u32 target_loc) {
+    int low = 0;
+    int high = length - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table[mid].loc < target_loc) {
+            low = mid + 1;
+        } else if (table[mid].loc > target_loc) {
+            high = mid - 1;
+        } else {
+            return &table[mid];
+        }
+    }
+    if (low <= 0) {
+        return NULL;
+    }
+    FrameDesc *f = &table[low - 1];
+    return target_loc > f->loc_end ? NULL : f;
+}
+
+// The call stack walked from bench_library_callback
+static const int LIBRARY_WALK_DEPTH = 64;
+static uintptr_t library_walk[LIBRARY_WALK_DEPTH];
+static int library_walk_depth;
+
+static __attribute__((noinline)) void bench_library_callback(void) {
+    StackContext sc;
+    populateStackContext(sc, NULL);
+    library_walk_depth = stackWalk(unwinderLibraries(), sc, library_walk, LIBRARY_WALK_DEPTH, 0);
+}
+
+typedef void (*library_call_func)(void (*)(void));
+
+// Calls the library function, which calls back bench_library_callback, and
+// returns whether the walk from there got back here through the library
+static __attribute__((noinline)) int bench_walk_through(library_call_func f, const void* library) {
+    library_walk_depth = 0;
+    f(bench_library_callback);
+    __asm__ volatile("" : : : "memory");
+
+    // A return address here is after the call, within a few bytes
+    const uintptr_t here = (uintptr_t)bench_walk_through;
+    for (int i = 0; i + 1 < library_walk_depth; i++) {
+        Dl_info info;
+        if (dladdr((const void*)library_walk[i], &info) != 0 && info.dli_fbase == library) {
+            return library_walk[i + 1] - here < 256;
+        }
+    }
+    return 0;
+}
+
+extern "C" {
+
+int async_cgo_traceback_internal_bench_unwinder_supported(int engine) {
+    return Unwinder::supported((UnwindEngine)engine);
+}
+
+uintptr_t async_cgo_traceback_internal_bench_walk_engine(int engine, int depth, int iterations) {
+    return bench_walk_engine(engine, depth, iterations);
+}
+
+uintptr_t async_cgo_traceback_internal_bench_snapshot(int depth, int window, int iterations, uint64_t *capture_ns,
+                                                      uint64_t *unwind_ns, uint64_t *bytes) {
+    *capture_ns = 0;
+    *unwind_ns = 0;
+    return bench_snapshot(depth, window, iterations, capture_ns, unwind_ns, bytes);
+}
+
+uintptr_t async_cgo_traceback_internal_bench_walk_memo(int depth, int iterations, int max_depth) {
+    return bench_walk_memo(depth, iterations, max_depth);
+}
+
+int async_cgo_traceback_internal_bench_memo_check(int depth, int iterations, int max_depth) {
+    return bench_memo_check(depth, iterations, max_depth);
+}
+
+void *async_cgo_traceback_internal_bench_libraries_create(int count) {
+    bench_libraries *b = new bench_libraries();
+    b->libs = new CodeCache*[count];
+    b->count = count;
+    for (int i = 0; i < count; i++) {
+        // Libraries are spaced out so that half of the lookups miss
+        const char* start = (const char*)(BENCH_LIB_BASE + i * 2 * BENCH_LIB_SIZE);
+        b->libs[i] = new CodeCache("bench", i, start, start + BENCH_LIB_SIZE);
+    }
+    b->array.lock();
+    b->array.update(b->libs, count, NULL, 0);
+    b->array.unlock();
+    return b;
+}
+
+void async_cgo_traceback_internal_bench_libraries_destroy(void *p) {
+    bench_libraries *b = (bench_libraries *)p;
+    for (int i = 0; i < b->count; i++) {
+        delete b->libs[i];
+    }
+    delete[] b->libs;
+    delete b;
+}
+
+uintptr_t async_cgo_traceback_internal_bench_find_library(void *p, int iterations, int linear) {
+    bench_libraries *b = (bench_libraries *)p;
+    uint64_t state = 88172645463325252ULL;
+    uintptr_t found = 0;
+    for (int i = 0; i < iterations; i++) {
+        const void* address = bench_address(state, b->count);
+        CodeCache* cc = NULL;
+        if (linear) {
+            for (int j = 0; j < b->count; j++) {
+                if (b->libs[j]->contains(address)) {
+                    cc = b->libs[j];
+                    break;
+                }
+            }
+        } else {
+            cc = b->array.find(address);
+        }
+        found += cc != NULL;
+    }
+    return found;
+}
+
+uintptr_t async_cgo_traceback_internal_bench_walk(int depth, int iterations) {
+    return bench_walk(depth, iterations);
+}
+
+void *async_cgo_traceback_internal_bench_unwind_tables_create(uint64_t *flat_bytes, uint64_t *compact_bytes) {
+    bench_unwind_tables *b = new bench_unwind_tables();
+    b->rows = 0;
+    *flat_bytes = 0;
+    *compact_bytes = 0;
+
+    CodeCacheArray *cache = unwinderLibraries();
+    cache->lock();
+    for (int i = 0; i < cache->count(); i++) {
+        CodeCache *cc = (*cache)[i];
+        if (cc->ehFrameHdr() == NULL) {
+            continue;
+        }
+        DwarfParser dwarf(cc->name(), cc->getTextBase(), cc->ehFrameHdr());
+        UnwindTable *t = UnwindTable::build(dwarf.table(), dwarf.count());
+        if (t == NULL) {
+            free(dwarf.table());
+            continue;
+        }
+        b->flat.push_back(dwarf.table());
+        b->flat_count.push_back(dwarf.count());
+        b->compact.push_back(t);
+        b->text_base.push_back(cc->getTextBase());
+        b->eh_frame_hdr.push_back(cc->ehFrameHdr());
+        b->load_id.push_back(cc->loadId());
+        b->rows += dwarf.count();
+        *flat_bytes += dwarf.count() * sizeof(FrameDesc);
+        *compact_bytes += t->size();
+    }
+    cache->unlock();
+    return b;
+}
+
+void async_cgo_traceback_internal_bench_unwind_tables_destroy(void *p) {
+    bench_unwind_tables *b = (bench_unwind_tables *)p;
+    for (size_t i = 0; i < b->flat.size(); i++) {
+        free(b->flat[i]);
+        UnwindTable::destroy(b->compact[i]);
+    }
+    delete b;
+}
+
+// Formats for async_cgo_traceback_internal_bench_unwind_tables_lookup
+enum {
+    BENCH_FLAT,
+    BENCH_COMPACT,
+    BENCH_ON_DEMAND
+};
+
+uintptr_t async_cgo_traceback_internal_bench_unwind_tables_lookup(void *p, int iterations, int format) {
+    bench_unwind_tables *b = (bench_unwind_tables *)p;
+    if (b->rows == 0) {
+        return 0;
+    }
+    uint64_t state = 88172645463325252ULL;
+    uintptr_t found = 0;
+    for (int i = 0; i < iterations; i++) {
+        // Pick a random row, then a location at or just after it, so that
+        // libraries are sampled in proportion to the size of their tables
+        uint64_t r = xorshift(state);
+        int row = (r >> 32) % b->rows;
+        size_t lib = 0;
+        while (row >= b->flat_count[lib]) {
+            row -= b->flat_count[lib++];
+        }
+        u32 loc = b->flat[lib][row].loc + (r & 63);
+        u32 start, end;
+        if (format == BENCH_FLAT) {
+            found += bench_flat_find(b->flat[lib], b->flat_count[lib], loc) != NULL;
+        } else if (format == BENCH_COMPACT) {
+            found += b->compact[lib]->find(loc, &start, &end) != NULL;
+        } else {
+            FrameDesc frame;
+            found += FdeCache::findFrameDesc(b->load_id[lib], b->text_base[lib], b->eh_frame_hdr[lib], loc, frame, &start, &end);
+        }
+    }
+    return found;
+}
+
+// Returns the number of locations where the flat and compact tables disagree
+uintptr_t async_cgo_traceback_internal_bench_unwind_tables_check(void *p) {
+    bench_unwind_tables *b = (bench_unwind_tables *)p;
+    uintptr_t mismatches = 0;
+    for (size_t lib = 0; lib < b->flat.size(); lib++) {
+        FrameDesc *table = b->flat[lib];
+        int count = b->flat_count[lib];
+        for (int i = 0; i < count; i++) {
+            u32 locs[] = {table[i].loc, table[i].loc + 1, table[i].loc_end, table[i].loc_end + 1};
+            for (size_t j = 0; j < sizeof(locs) / sizeof(locs[0]); j++) {
+                FrameDesc *want = bench_flat_find(table, count, locs[j]);
+                u32 start, end;
+                FrameDesc *got = b->compact[lib]->find(locs[j], &start, &end);
+                if (want == NULL || got == NULL) {
+                    mismatches += want != got;
+                } else if (want->cfa != got->cfa || want->fp_off != got->fp_off) {
+                    mismatches++;
+                } else if (locs[j] < start || locs[j] >= end) {
+                    mismatches++;
+                }
+
+                // When building tables, the first row of an FDE is dropped if
+                // it has the same rule as the last row of the previous FDE,
+                // leaving a gap if they aren't contiguous. Decoding FDEs one
+                // at a time doesn't have that problem.
+                FrameDesc decoded;
+                bool found = FdeCache::findFrameDesc(b->load_id[lib], b->text_base[lib], b->eh_frame_hdr[lib], locs[j], decoded, &start, &end);
+                if (want == NULL) {
+                    continue;
+                } else if (!found) {
+                    mismatches++;
+                } else if (want->cfa != decoded.cfa || want->fp_off != decoded.fp_off) {
+                    mismatches++;
+                } else if (locs[j] < start || locs[j] >= end) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+// Creates a library with count synthetic symbols, named like Go functions,
+// and sorts it, building the name indexes if index is non-zero
+void *async_cgo_traceback_internal_bench_symbols_create(int count, int index) {
+    CodeCache *cc = new CodeCache("bench");
+    uint64_t state = 88172645463325252ULL;
+    char name[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "pkg%u.func%u", (unsigned)(xorshift(state) % 1000), i);
+        cc->add((const void *)(BENCH_LIB_BASE + 16 * i), 16, name);
+    }
+    cc->sort();
+    cc->setNameIndexEnabled(index != 0);
+    // The indexes are built by the first lookups
+    cc->findSymbol("");
+    cc->findSymbolByPrefix("");
+    return cc;
+}
+
+void async_cgo_traceback_internal_bench_symbols_destroy(void *p) {
+    delete (CodeCache *)p;
+}
+
+// Opens a library with dlopen and returns its function which takes a callback
+// and calls it, or NULL
+void *async_cgo_traceback_internal_bench_library_open(const char *path, const char *symbol, void **handle) {
+    *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (*handle == NULL) {
+        return NULL;
+    }
+    return dlsym(*handle, symbol);
+}
+
+// Returns whether the stack walked from a callback of the library function f
+// includes the library's frame and its caller
+int async_cgo_traceback_internal_bench_walk_library(void *f) {
+    Dl_info info;
+    if (dladdr(f, &info) == 0) {
+        return 0;
+    }
+    return bench_walk_through((library_call_func)f, info.dli_fbase);
+}
+
+void async_cgo_traceback_internal_bench_library_close(void *handle) {
+    dlclose(handle);
+}
+
+// Copies the name of the unwinder's library with the address to name, and
+// returns whether it has one
+int async_cgo_traceback_internal_bench_library_name(uintptr_t address, char *name, size_t size) {
+    CodeCacheArray *cache = unwinderLibraries();
+    cache->lock();
+    CodeCache *cc = cache->find((const void *)address);
+    if (cc != NULL) {
+        strncpy(name, cc->name(), size - 1);
+        name[size - 1] = 0;
+    }
+    cache->unlock();
+    return cc != NULL;
+}
+
+// Looks up a symbol of a library made by bench_symbols_create, by exact name
+// or by prefix, and returns its address
+uintptr_t async_cgo_traceback_internal_bench_lookup_symbol(void *p, const char *name, int prefix) {
+    CodeCache *cc = (CodeCache *)p;
+    return (uintptr_t)(prefix ? cc->findSymbolByPrefix(name) : cc->findSymbol(name));
+}
+
+// Looks up iterations random symbols of a library made by bench_symbols_create,
+// by exact name or by a prefix, and returns how many were found
+uintptr_t async_cgo_traceback_internal_bench_find_symbol(void *p, int count, int iterations, int prefix) {
+    CodeCache *cc = (CodeCache *)p;
+    uint64_t state = 88172645463325252ULL;
+    uintptr_t found = 0;
+    char name[64];
+    for (int i = 0; i < iterations; i++) {
+        unsigned pkg = (unsigned)(xorshift(state) % 1000);
+        if (prefix) {
+            snprintf(name, sizeof(name), "pkg%u.", pkg);
+            found += cc->findSymbolByPrefix(name) != NULL;
+        } else {
+            // Half of the lookups are for names which don't exist
+            snprintf(name, sizeof(name), "pkg%u.func%u", pkg, (unsigned)(xorshift(state) % (2 * count)));
+            found += cc->findSymbol(name) != NULL;
+        }
+    }
+    return found;
+}
+
+// Parses every loaded library into a new CodeCacheArray, as done at startup,
+// using the given modes and number of threads. Returns the total size of the
+// unwind tables built, and the number of symbols loaded and the memory they
+// take.
+uint64_t async_cgo_traceback_internal_bench_parse_libraries(int dwarf_mode, int symbol_mode, int threads,
+                                                            uint64_t *symbols, uint64_t *symbol_bytes) {
+    DwarfMode old_dwarf_mode = Symbols::dwarfMode();
+    SymbolMode old_symbol_mode = Symbols::symbolMode();
+    Symbols::setDwarfMode((DwarfMode)dwarf_mode);
+    Symbols::setSymbolMode((SymbolMode)symbol_mode);
+    Symbols::setParseThreads(threads);
+    CodeCacheArray *array = new CodeCacheArray();
+    Symbols::parseLibraries(array, false);
+    Symbols::setParseThreads(0);
+    Symbols::setSymbolMode(old_symbol_mode);
+    Symbols::setDwarfMode(old_dwarf_mode);
+
+    uint64_t table_bytes = 0;
+    *symbols = 0;
+    *symbol_bytes = 0;
+    for (int i = 0; i < array->count(); i++) {
+        CodeCache *cc = (*array)[i];
+        *symbols += cc->count();
+        *symbol_bytes += cc->symbolMemory();
+        if (cc->unwindTable() != NULL) {
+            table_bytes += cc->unwindTable()->size();
+        }
+        delete cc;
+    }
+    delete array;
+    return table_bytes;
+}
+
+// Parses every loaded library into a new CodeCacheArray with the given DWARF
+// mode, and without symbols
+void *async_cgo_traceback_internal_bench_library_frames_create(int dwarf_mode) {
+    DwarfMode old_dwarf_mode = Symbols::dwarfMode();
+    SymbolMode old_symbol_mode = Symbols::symbolMode();
+    Symbols::setDwarfMode((DwarfMode)dwarf_mode);
+    Symbols::setSymbolMode(SYMBOLS_NONE);
+    CodeCacheArray *array = new CodeCacheArray();
+    Symbols::parseLibraries(array, false);
+    Symbols::setSymbolMode(old_symbol_mode);
+    Symbols::setDwarfMode(old_dwarf_mode);
+    return array;
+}
+
+void async_cgo_traceback_internal_bench_library_frames_destroy(void *p) {
+    CodeCacheArray *array = (CodeCacheArray *)p;
+    for (int i = 0; i < array->count(); i++) {
+        delete (*array)[i];
+    }
+    delete array;
+}
+
+// Looks up the frame descriptions of the count locations from f in an array
+// made by bench_library_frames_create, which is never refreshed, so it still
+// has the libraries unloaded since. Stores the CFA of each one found in cfa,
+// or -1, and returns how many were found.
+int async_cgo_traceback_internal_bench_library_frames(void *p, uintptr_t f, int count, int *cfa) {
+    CodeCacheArray *array = (CodeCacheArray *)p;
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        CodeCache *cc = array->find((const void *)(f + i));
+        FrameDesc frame;
+        if (cc != NULL && cc->findFrameDesc((const void *)(f + i), frame)) {
+            cfa[i] = frame.cfa;
+            found++;
+        } else {
+            cfa[i] = -1;
+        }
+    }
+    return found;
+}
+
+// Sets the PersistentCache directory. An empty string disables the cache.
+void async_cgo_traceback_internal_set_cache_dir(const char *dir) {
+    PersistentCache::setDirectory(dir);
+}
+
+void async_cgo_traceback_internal_fde_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *bytes) {
+    FdeCache::Stats stats;
+    FdeCache::getStats(stats);
+    *hits = stats.hits;
+    *misses = stats.misses;
+    *bytes = FdeCache::size();
+}
+
+} // extern "C"
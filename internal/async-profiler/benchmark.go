@@ -0,0 +1,299 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+package asyncprofiler
+
+/*
+#cgo linux LDFLAGS: -ldl
+
+#include <stdint.h>
+#include <stdlib.h>
+
+extern void *async_cgo_traceback_internal_bench_libraries_create(int);
+extern void async_cgo_traceback_internal_bench_libraries_destroy(void *);
+extern uintptr_t async_cgo_traceback_internal_bench_find_library(void *, int, int);
+extern uintptr_t async_cgo_traceback_internal_bench_walk(int, int);
+extern uintptr_t async_cgo_traceback_internal_bench_walk_memo(int, int, int);
+extern int async_cgo_traceback_internal_bench_memo_check(int, int, int);
+extern int async_cgo_traceback_internal_bench_unwinder_supported(int);
+extern uintptr_t async_cgo_traceback_internal_bench_walk_engine(int, int, int);
+extern uintptr_t async_cgo_traceback_internal_bench_snapshot(int, int, int, uint64_t *, uint64_t *, uint64_t *);
+extern void *async_cgo_traceback_internal_bench_unwind_tables_create(uint64_t *, uint64_t *);
+extern void async_cgo_traceback_internal_bench_unwind_tables_destroy(void *);
+extern uintptr_t async_cgo_traceback_internal_bench_unwind_tables_lookup(void *, int, int);
+extern uintptr_t async_cgo_traceback_internal_bench_unwind_tables_check(void *);
+extern void *async_cgo_traceback_internal_bench_symbols_create(int, int);
+extern void async_cgo_traceback_internal_bench_symbols_destroy(void *);
+extern uintptr_t async_cgo_traceback_internal_bench_find_symbol(void *, int, int, int);
+extern uintptr_t async_cgo_traceback_internal_bench_lookup_symbol(void *, const char *, int);
+extern void *async_cgo_traceback_internal_bench_library_open(const char *, const char *, void **);
+extern int async_cgo_traceback_internal_bench_walk_library(void *);
+extern void async_cgo_traceback_internal_bench_library_close(void *);
+extern int async_cgo_traceback_internal_bench_library_name(uintptr_t, char *, size_t);
+extern uint64_t async_cgo_traceback_internal_bench_parse_libraries(int, int, int, uint64_t *, uint64_t *);
+extern void *async_cgo_traceback_internal_bench_library_frames_create(int);
+extern void async_cgo_traceback_internal_bench_library_frames_destroy(void *);
+extern int async_cgo_traceback_internal_bench_library_frames(void *, uintptr_t, int, int *);
+extern void async_cgo_traceback_internal_set_cache_dir(const char*);
+extern void async_cgo_traceback_internal_fde_cache_stats(uint64_t *, uint64_t *, uint64_t *);
+*/
+import "C"
+import (
+	"time"
+	"unsafe"
+)
+
+// benchLibraries is a set of synthetic libraries used to benchmark library
+// lookup by address
+type benchLibraries struct {
+	p unsafe.Pointer
+}
+
+func newBenchLibraries(count int) benchLibraries {
+	return benchLibraries{C.async_cgo_traceback_internal_bench_libraries_create(C.int(count))}
+}
+
+func (b benchLibraries) close() {
+	C.async_cgo_traceback_internal_bench_libraries_destroy(b.p)
+}
+
+// findLibrary looks up n random addresses and returns how many were found in
+// a library. If linear is true, every library is checked in turn rather than
+// using the address index.
+func (b benchLibraries) findLibrary(n int, linear bool) int {
+	var l C.int
+	if linear {
+		l = 1
+	}
+	return int(C.async_cgo_traceback_internal_bench_find_library(b.p, C.int(n), l))
+}
+
+// benchSymbols is a library with synthetic symbols, used to benchmark symbol
+// lookup by name
+type benchSymbols struct {
+	p     unsafe.Pointer
+	count int
+}
+
+// newBenchSymbols creates a library with count symbols, with or without the
+// name indexes
+func newBenchSymbols(count int, index bool) benchSymbols {
+	var i C.int
+	if index {
+		i = 1
+	}
+	return benchSymbols{C.async_cgo_traceback_internal_bench_symbols_create(C.int(count), i), count}
+}
+
+func (b benchSymbols) close() {
+	C.async_cgo_traceback_internal_bench_symbols_destroy(b.p)
+}
+
+// lookup returns the address of the symbol with the given name, or starting
+// with it if prefix is true, or 0 if there isn't one
+func (b benchSymbols) lookup(name string, prefix bool) uintptr {
+	var p C.int
+	if prefix {
+		p = 1
+	}
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	return uintptr(C.async_cgo_traceback_internal_bench_lookup_symbol(b.p, cname, p))
+}
+
+// findSymbol looks up n random symbols, by exact name or by prefix, and
+// returns how many were found
+func (b benchSymbols) findSymbol(n int, prefix bool) int {
+	var p C.int
+	if prefix {
+		p = 1
+	}
+	return int(C.async_cgo_traceback_internal_bench_find_symbol(b.p, C.int(b.count), C.int(n), p))
+}
+
+// benchWalk recurses depth times in C++ and then unwinds the stack n times,
+// returning the total number of frames unwound
+func benchWalk(depth, n int) int {
+	return int(C.async_cgo_traceback_internal_bench_walk(C.int(depth), C.int(n)))
+}
+
+// benchWalkUnwinder recurses depth times in C++ and then unwinds the stack n
+// times with the given unwinder, returning the total number of frames
+// unwound. It returns 0 if the unwinder isn't supported.
+func benchWalkUnwinder(u Unwinder, depth, n int) int {
+	if C.async_cgo_traceback_internal_bench_unwinder_supported(C.int(u)) == 0 {
+		return 0
+	}
+	return int(C.async_cgo_traceback_internal_bench_walk_engine(C.int(u), C.int(depth), C.int(n)))
+}
+
+// benchSnapshot recurses depth times in C++ and then takes n snapshots of the
+// stack with window bytes each, unwinding them in batches. It returns the
+// total number of frames unwound, the time spent taking and unwinding the
+// snapshots, and the bytes of stack copied.
+func benchSnapshot(depth, window, n int) (frames int, capture, unwind time.Duration, bytes uint64) {
+	var c, u, s C.uint64_t
+	frames = int(C.async_cgo_traceback_internal_bench_snapshot(C.int(depth), C.int(window), C.int(n), &c, &u, &s))
+	return frames, time.Duration(c), time.Duration(u), uint64(s)
+}
+
+// benchWalkMemo recurses depth times in C++ and then does n memoized walks of
+// up to maxDepth frames, each from between 0 and 3 frames further down,
+// returning the total number of frames unwound
+func benchWalkMemo(depth, n, maxDepth int) int {
+	return int(C.async_cgo_traceback_internal_bench_walk_memo(C.int(depth), C.int(n), C.int(maxDepth)))
+}
+
+// checkWalkMemo recurses depth times in C++ and then takes n samples from a
+// few frames further down, through varying call paths. Each sample walks the
+// same stack with stackWalkMemo and stackWalk, and it returns how many times
+// they disagreed.
+func checkWalkMemo(depth, n, maxDepth int) int {
+	return int(C.async_cgo_traceback_internal_bench_memo_check(C.int(depth), C.int(n), C.int(maxDepth)))
+}
+
+// benchUnwindTables holds the unwind tables of every loaded library in both
+// the flat FrameDesc form and the compact UnwindTable form
+type benchUnwindTables struct {
+	p            unsafe.Pointer
+	flatBytes    uint64
+	compactBytes uint64
+}
+
+func newBenchUnwindTables() benchUnwindTables {
+	var flat, compact C.uint64_t
+	p := C.async_cgo_traceback_internal_bench_unwind_tables_create(&flat, &compact)
+	return benchUnwindTables{p: p, flatBytes: uint64(flat), compactBytes: uint64(compact)}
+}
+
+func (b benchUnwindTables) close() {
+	C.async_cgo_traceback_internal_bench_unwind_tables_destroy(b.p)
+}
+
+// Ways of finding frame descriptions, in the same order as the C++ enum
+const (
+	formatFlat = iota
+	formatCompact
+	formatOnDemand
+)
+
+// lookup finds the frame descriptions for n random locations in the given
+// format and returns how many were found
+func (b benchUnwindTables) lookup(n int, format int) int {
+	return int(C.async_cgo_traceback_internal_bench_unwind_tables_lookup(b.p, C.int(n), C.int(format)))
+}
+
+// fdeCacheStats returns the hits and misses of the decoded FDE cache used in
+// the on-demand DWARF mode, and the size of the cache
+func fdeCacheStats() (hits, misses, bytes uint64) {
+	var h, m, s C.uint64_t
+	C.async_cgo_traceback_internal_fde_cache_stats(&h, &m, &s)
+	return uint64(h), uint64(m), uint64(s)
+}
+
+// check returns the number of locations for which the flat and compact tables
+// give different frame descriptions
+func (b benchUnwindTables) check() int {
+	return int(C.async_cgo_traceback_internal_bench_unwind_tables_check(b.p))
+}
+
+// DWARF modes, in the same order as the C++ DwarfMode enum
+const (
+	dwarfEager = iota
+	dwarfLazy
+	dwarfOnDemand
+)
+
+// Symbol modes, in the same order as the C++ SymbolMode enum
+const (
+	symbolsAll = iota
+	symbolsNone
+)
+
+// parseStats describes the libraries parsed by benchParseLibraries
+type parseStats struct {
+	tableBytes  uint64
+	symbols     uint64
+	symbolBytes uint64
+}
+
+// benchParseLibraries parses the loaded libraries as done at startup with the
+// given DWARF and symbol modes and number of worker threads
+func benchParseLibraries(dwarfMode, symbolMode, workers int) parseStats {
+	var symbols, symbolBytes C.uint64_t
+	tableBytes := C.async_cgo_traceback_internal_bench_parse_libraries(C.int(dwarfMode), C.int(symbolMode), C.int(workers), &symbols, &symbolBytes)
+	return parseStats{uint64(tableBytes), uint64(symbols), uint64(symbolBytes)}
+}
+
+// libraryFrames has the loaded libraries parsed with a DWARF mode, and is
+// never updated, like the unwinder's libraries between two checks
+type libraryFrames struct {
+	p unsafe.Pointer
+}
+
+func newLibraryFrames(dwarfMode int) libraryFrames {
+	return libraryFrames{C.async_cgo_traceback_internal_bench_library_frames_create(C.int(dwarfMode))}
+}
+
+func (f libraryFrames) close() {
+	C.async_cgo_traceback_internal_bench_library_frames_destroy(f.p)
+}
+
+// cfas returns the CFA rule of each of the first n locations of the
+// library's function, or -1 for those without a frame description, and how
+// many have one
+func (f libraryFrames) cfas(l benchLibrary, n int) ([]int, int) {
+	cfa := make([]C.int, n)
+	found := C.async_cgo_traceback_internal_bench_library_frames(f.p, C.uintptr_t(uintptr(l.call)), C.int(n), &cfa[0])
+	cfas := make([]int, n)
+	for i := range cfa {
+		cfas[i] = int(cfa[i])
+	}
+	return cfas, int(found)
+}
+
+// setCacheDir sets the directory of the persistent cache of parsed libraries.
+// An empty string disables it.
+func setCacheDir(dir string) {
+	cdir := C.CString(dir)
+	defer C.free(unsafe.Pointer(cdir))
+	C.async_cgo_traceback_internal_set_cache_dir(cdir)
+}
+
+// benchLibrary is a library loaded with dlopen, with a function which takes a
+// callback and calls it
+type benchLibrary struct {
+	handle unsafe.Pointer
+	call   unsafe.Pointer
+}
+
+func openBenchLibrary(path, symbol string) (benchLibrary, bool) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	csymbol := C.CString(symbol)
+	defer C.free(unsafe.Pointer(csymbol))
+	var l benchLibrary
+	l.call = C.async_cgo_traceback_internal_bench_library_open(cpath, csymbol, &l.handle)
+	return l, l.call != nil
+}
+
+// walkThrough reports whether a stack walked from a callback of the library's
+// function unwinds the library's frame to get back to its caller
+func (l benchLibrary) walkThrough() bool {
+	return C.async_cgo_traceback_internal_bench_walk_library(l.call) != 0
+}
+
+func (l benchLibrary) close() {
+	if l.handle != nil {
+		C.async_cgo_traceback_internal_bench_library_close(l.handle)
+	}
+}
+
+// name returns the unwinder's name for the library, and whether it has it
+func (l benchLibrary) name() (string, bool) {
+	var buf [4096]C.char
+	if C.async_cgo_traceback_internal_bench_library_name(C.uintptr_t(uintptr(l.call)), &buf[0], C.size_t(len(buf))) == 0 {
+		return "", false
+	}
+	return C.GoString(&buf[0]), true
+}
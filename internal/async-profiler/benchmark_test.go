@@ -0,0 +1,264 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+package asyncprofiler
+
+import (
+	"fmt"
+	"sync"
+	"testing"
+	"time"
+)
+
+func BenchmarkFindLibrary(b *testing.B) {
+	for _, count := range []int{10, 300, 2000} {
+		libs := newBenchLibraries(count)
+		for _, method := range []string{"index", "linear"} {
+			b.Run(fmt.Sprintf("libs=%d/%s", count, method), func(b *testing.B) {
+				libs.findLibrary(b.N, method == "linear")
+			})
+		}
+		libs.close()
+	}
+}
+
+func BenchmarkFindSymbol(b *testing.B) {
+	for _, count := range []int{1000, 200000} {
+		for _, index := range []bool{true, false} {
+			syms := newBenchSymbols(count, index)
+			for _, lookup := range []string{"exact", "prefix"} {
+				b.Run(fmt.Sprintf("symbols=%d/index=%v/%s", count, index, lookup), func(b *testing.B) {
+					syms.findSymbol(b.N, lookup == "prefix")
+				})
+			}
+			syms.close()
+		}
+	}
+}
+
+func BenchmarkWalk(b *testing.B) {
+	for _, depth := range []int{8, 64} {
+		for _, cache := range []bool{true, false} {
+			b.Run(fmt.Sprintf("depth=%d/cache=%v", depth, cache), func(b *testing.B) {
+				SetUnwindCacheEnabled(cache)
+				defer SetUnwindCacheEnabled(true)
+				before := GetUnwindCacheStats()
+				reads := GetStackReadStats()
+				start := time.Now()
+				frames := benchWalk(depth, b.N)
+				elapsed := time.Since(start)
+				after := GetUnwindCacheStats()
+				b.ReportMetric(float64(elapsed.Nanoseconds())/float64(frames), "ns/frame")
+				b.ReportMetric(float64(GetStackReadStats().Fallback-reads.Fallback)/float64(frames), "fallbacks/frame")
+				if cache {
+					hits := (after.FrameHits - before.FrameHits) + (after.LibHits - before.LibHits)
+					total := hits + (after.Misses - before.Misses)
+					if total > 0 {
+						b.ReportMetric(float64(after.FrameHits-before.FrameHits)/float64(total), "frame-hit-rate")
+						b.ReportMetric(float64(hits)/float64(total), "lib-hit-rate")
+					}
+				}
+			})
+		}
+	}
+}
+
+// BenchmarkSnapshot compares the two sides of stack snapshots with
+// BenchmarkWalk, which unwinds in place: taking the snapshot, which is what a
+// signal handler would do, and unwinding it later
+func BenchmarkSnapshot(b *testing.B) {
+	for _, depth := range []int{8, 64} {
+		for _, window := range []int{2048, 8192, 32768} {
+			b.Run(fmt.Sprintf("depth=%d/window=%d", depth, window), func(b *testing.B) {
+				frames, capture, unwind, bytes := benchSnapshot(depth, window, b.N)
+				b.ReportMetric(float64(capture.Nanoseconds())/float64(b.N), "capture-ns/op")
+				b.ReportMetric(float64(unwind.Nanoseconds())/float64(b.N), "unwind-ns/op")
+				b.ReportMetric(float64(frames)/float64(b.N), "frames/op")
+				b.ReportMetric(float64(bytes)/float64(b.N), "bytes/op")
+			})
+		}
+	}
+}
+
+func BenchmarkUnwinder(b *testing.B) {
+	unwinders := []struct {
+		name string
+		u    Unwinder
+	}{
+		{"dwarf", UnwinderDWARF},
+		{"fp", UnwinderFramePointer},
+		{"gcc", UnwinderGCC},
+	}
+	for _, u := range unwinders {
+		for _, depth := range []int{8, 64} {
+			b.Run(fmt.Sprintf("%s/depth=%d", u.name, depth), func(b *testing.B) {
+				if benchWalkUnwinder(u.u, 0, 1) == 0 {
+					b.Skip("unwinder not supported")
+				}
+				start := time.Now()
+				frames := benchWalkUnwinder(u.u, depth, b.N)
+				elapsed := time.Since(start)
+				b.ReportMetric(float64(elapsed.Nanoseconds())/float64(frames), "ns/frame")
+				b.ReportMetric(float64(frames)/float64(b.N), "frames/walk")
+			})
+		}
+	}
+}
+
+func BenchmarkWalkMemo(b *testing.B) {
+	// The runtime asks for at most 32 frames for a profile sample
+	const maxDepth = 32
+	for _, depth := range []int{8, 64, 512} {
+		for _, memo := range []bool{true, false} {
+			b.Run(fmt.Sprintf("depth=%d/memo=%v", depth, memo), func(b *testing.B) {
+				SetStackMemoEnabled(memo)
+				defer SetStackMemoEnabled(true)
+				hits, misses := GetStackMemoStats()
+				start := time.Now()
+				frames := benchWalkMemo(depth, b.N, maxDepth)
+				elapsed := time.Since(start)
+				b.ReportMetric(float64(elapsed.Nanoseconds())/float64(frames), "ns/frame")
+				b.ReportMetric(float64(frames)/float64(b.N), "frames/walk")
+				if memo {
+					h, m := GetStackMemoStats()
+					b.ReportMetric(float64(h-hits)/float64(h-hits+m-misses), "hit-rate")
+				}
+			})
+		}
+	}
+}
+
+func BenchmarkFrameDescLookup(b *testing.B) {
+	tables := newBenchUnwindTables()
+	defer tables.close()
+	formats := []struct {
+		name   string
+		format int
+	}{
+		{"flat", formatFlat},
+		{"compact", formatCompact},
+		{"ondemand", formatOnDemand},
+	}
+	for _, f := range formats {
+		b.Run(f.name, func(b *testing.B) {
+			hits, misses, bytes := fdeCacheStats()
+			switch f.format {
+			case formatFlat:
+				bytes = tables.flatBytes
+			case formatCompact:
+				bytes = tables.compactBytes
+			}
+			b.ReportMetric(float64(bytes), "table-bytes")
+			tables.lookup(b.N, f.format)
+			if f.format == formatOnDemand {
+				h, m, _ := fdeCacheStats()
+				b.ReportMetric(float64(h-hits)/float64(h-hits+m-misses), "hit-rate")
+			}
+		})
+	}
+}
+
+func BenchmarkParseLibraries(b *testing.B) {
+	modes := []struct {
+		name string
+		mode int
+	}{
+		{"eager", dwarfEager},
+		{"lazy", dwarfLazy},
+		{"ondemand", dwarfOnDemand},
+	}
+	for _, m := range modes {
+		for _, workers := range []int{1, 4, 16} {
+			b.Run(fmt.Sprintf("%s/workers=%d", m.name, workers), func(b *testing.B) {
+				var stats parseStats
+				for i := 0; i < b.N; i++ {
+					stats = benchParseLibraries(m.mode, symbolsAll, workers)
+				}
+				b.ReportMetric(float64(stats.tableBytes), "table-bytes")
+			})
+		}
+	}
+}
+
+func BenchmarkParseLibrariesCached(b *testing.B) {
+	modes := []struct {
+		name string
+		mode int
+	}{
+		{"eager", dwarfEager},
+		{"lazy", dwarfLazy},
+	}
+	for _, m := range modes {
+		b.Run(m.name, func(b *testing.B) {
+			setCacheDir(b.TempDir())
+			defer setCacheDir("")
+			// Populate the cache
+			benchParseLibraries(m.mode, symbolsAll, 1)
+			b.ResetTimer()
+			var stats parseStats
+			for i := 0; i < b.N; i++ {
+				stats = benchParseLibraries(m.mode, symbolsAll, 1)
+			}
+			b.ReportMetric(float64(stats.tableBytes), "table-bytes")
+		})
+	}
+}
+
+func BenchmarkParseLibrariesSymbols(b *testing.B) {
+	modes := []struct {
+		name string
+		mode int
+	}{
+		{"all", symbolsAll},
+		{"none", symbolsNone},
+	}
+	for _, m := range modes {
+		b.Run(m.name, func(b *testing.B) {
+			var stats parseStats
+			for i := 0; i < b.N; i++ {
+				stats = benchParseLibraries(dwarfEager, m.mode, 1)
+			}
+			b.ReportMetric(float64(stats.symbols), "symbols")
+			b.ReportMetric(float64(stats.symbolBytes), "symbol-bytes")
+		})
+	}
+}
+
+// stackWalkMemo takes the older frames of a call stack from the last walk on
+// the thread, so it must find exactly what a full walk of the same stack
+// does, however the stack changed since
+func TestWalkMemoMatchesWalk(t *testing.T) {
+	for _, maxDepth := range []int{8, 32, 64} {
+		for _, depth := range []int{0, 40} {
+			hits, _ := GetStackMemoStats()
+			if n := checkWalkMemo(depth, 2000, maxDepth); n != 0 {
+				t.Errorf("depth=%d maxDepth=%d: memoized walks disagreed with full walks %d times", depth, maxDepth, n)
+			}
+			// The memo only covers the first 32 frames, so it can't
+			// supply the rest of deeper walks
+			if h, _ := GetStackMemoStats(); h == hits && (maxDepth <= 32 || depth == 0) {
+				t.Errorf("depth=%d maxDepth=%d: no walk reused the memo", depth, maxDepth)
+			}
+		}
+	}
+}
+
+// Chains are allocated and released on many threads at once, each through
+// the same lock-free free list
+func TestOverflowArenaConcurrent(t *testing.T) {
+	var wg sync.WaitGroup
+	bad := make([]int, 8)
+	for i := range bad {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			bad[i] = CheckOverflowArena(50000, 200)
+		}(i)
+	}
+	wg.Wait()
+	for i, n := range bad {
+		if n > 0 {
+			t.Errorf("goroutine %d: %d chains didn't hold what was stored", i, n)
+		}
+	}
+}
@@ -1,9 +1,18 @@
 #include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
 #include <ucontext.h>
 
 #include "codeCache.h"
+#include "stackSnapshot.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "unwinder.h"
+#include "unwindWorker.h"
 
 struct CodeCacheArraySingleton {
     static CodeCacheArray *getInstance();
@@ -20,36 +29,126 @@ CodeCacheArray *CodeCacheArraySingleton::getInstance() {
     return instance;
 }
 
-static CodeBlob *asmcgocall_bounds = nullptr;
-static uintptr_t asmcgocall_base = 0;
+CodeCacheArray *unwinderLibraries() {
+    return CodeCacheArraySingleton::getInstance();
+}
 
-static __attribute__((constructor)) void init(void) {
+// Set once the libraries have been parsed. Until then, call stacks are
+// unwound using only frame pointers.
+static int ready = 0;
+
+// An empty set of libraries, used before the real ones are ready, so that
+// every frame is unwound with the default frame pointer rule
+static CodeCacheArray no_libraries;
+
+static CodeCacheArray *readyLibraries() {
+    if (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) == 0) {
+        return &no_libraries;
+    }
+    return CodeCacheArraySingleton::getInstance();
+}
+
+static void initLibraries(void) {
     auto a = CodeCacheArraySingleton::getInstance();
+    // Record the loader's counters first, so that the UnwindWorker picks up
+    // any library loaded while parsing
+    Symbols::librariesChanged();
     Symbols::parseLibraries(a, false);
 
-    int count = a->count();
-    for (int i = 0; i < count; i++) {
-        CodeCache *c = a->operator[](i);
-        const void *p = NULL;
-        p = c->findSymbol("runtime.asmcgocall.abi0");
-        if (p == nullptr) {
-            // amscgocall name has "abi0" suffix on more recent Go versions
-            // but not on older versions
-            p = c->findSymbol("runtime.asmcgocall");
-        }
-        if (p == nullptr) {
-            continue;
-        }
-        auto cb = c->find(p);
-        if (cb != nullptr) {
-            asmcgocall_bounds = cb;
-            asmcgocall_base = (uintptr_t) c->getTextBase();
+    if (Symbols::dwarfMode() == DWARF_LAZY) {
+        // Every C->Go call unwinds through the cgo glue code in the Go
+        // runtime image, so it's not worth waiting for it. This code is
+        // linked into the same image, which works even if it's stripped
+        CodeCache *c = a->find((const void *) initLibraries);
+        if (c != nullptr) {
+            c->parseDwarfTable();
         }
     }
+    UnwindWorker::start(a);
+
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+#ifdef CGOTRACEBACK_BACKGROUND_INIT
+
+static void *initLibrariesThread(void *arg) {
+    initLibraries();
+    return NULL;
+}
+
+static __attribute__((constructor)) void init(void) {
+    cacheThreadStackBounds();
+
+    // Block all signals in the new thread, in particular SIGPROF, so that
+    // it doesn't get interrupted to unwind its own stack
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, initLibrariesThread, NULL);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        initLibraries();
+    }
+}
+
+#else
+
+static __attribute__((constructor)) void init(void) {
+    cacheThreadStackBounds();
+    initLibraries();
 }
 
+#endif // CGOTRACEBACK_BACKGROUND_INIT
+
+#ifdef __linux__
+
+// Profiling signals mostly land in C called from Go, on threads the Go
+// runtime created, which never make a C->Go call to cache their stack
+// bounds, and finding the bounds isn't signal safe. So the link wraps
+// pthread_create (see the LDFLAGS in cgotraceback.go), and threads created
+// by the Go runtime, or by any other code in the same executable, cache
+// their bounds before they start. Threads created elsewhere, such as by
+// another shared library, still cache them on their first C->Go call.
+struct ThreadStart {
+    void *(*start)(void *);
+    void *arg;
+};
+
+static void *startThread(void *p) {
+    ThreadStart ts = *(ThreadStart *) p;
+    free(p);
+    cacheThreadStackBounds();
+    return ts.start(ts.arg);
+}
+
+extern "C" int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                     void *(*start)(void *), void *arg);
+
+extern "C" int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                     void *(*start)(void *), void *arg) {
+    ThreadStart *ts = (ThreadStart *) malloc(sizeof(ThreadStart));
+    if (ts == NULL) {
+        return __real_pthread_create(thread, attr, start, arg);
+    }
+    ts->start = start;
+    ts->arg = arg;
+    int err = __real_pthread_create(thread, attr, startThread, ts);
+    if (err != 0) {
+        free(ts);
+    }
+    return err;
+}
+
+#endif // __linux__
+
 void populateStackContext(StackContext &sc, void *ucontext);
-bool stepStackContext(StackContext &sc, CodeCacheArray *cache);
 
 extern "C"  {
 
@@ -60,68 +159,593 @@ void async_cgo_traceback_internal_set_enabled(int value) {
     enabled = value;
 }
 
-#define STACK_MAX 32
+// Returns whether the libraries have been parsed and call stacks are being
+// unwound using their unwind tables
+int async_cgo_traceback_ready(void) {
+    return __atomic_load_n(&ready, __ATOMIC_ACQUIRE);
+}
+
+// Stores its return address in arg. The Go side calls this through
+// runtime.asmcgocall to find an address inside it.
+static __attribute__((noinline)) void store_return_address(void *arg) {
+    *(uintptr_t *) arg = (uintptr_t) __builtin_return_address(0);
+}
+
+void *async_cgo_traceback_internal_return_address_func(void) {
+    return (void *) store_return_address;
+}
+
+// Adds a range of addresses where unwinding stops, such as the bounds of
+// runtime.asmcgocall, which the Go side finds since the symbol may have been
+// stripped. If several Go runtimes in the process include this package,
+// they may all add to the same table.
+void async_cgo_traceback_add_stop_range(uintptr_t start, uintptr_t end) {
+    addStopRange((const void *) start, (const void *) end);
+}
+
+// Context capture modes. In CAPTURE_WHILE_PROFILING mode, C->Go calls only
+// save a context while a profiler is running, which is when the runtime CPU
+// profiler's interval timer is armed, or between calls to
+// async_cgo_traceback_profiler_started and async_cgo_traceback_profiler_stopped.
+#define CAPTURE_ALWAYS 0
+#define CAPTURE_WHILE_PROFILING 1
+
+// How many C->Go calls a thread makes between checks of the profilers
+#define CAPTURE_CHECK_INTERVAL 1024
+
+static int capture_mode = CAPTURE_ALWAYS;
+static int capture_active = 1;
+static int profilers = 0;
+static __thread unsigned capture_checks __attribute__((tls_model("initial-exec"))) = 0;
+
+static bool profilingActive(void) {
+    if (__atomic_load_n(&profilers, __ATOMIC_RELAXED) > 0) {
+        return true;
+    }
+    struct itimerval it;
+    return getitimer(ITIMER_PROF, &it) == 0 && (it.it_value.tv_sec != 0 || it.it_value.tv_usec != 0);
+}
+
+// Returns whether a C->Go call should save a context. Turning capture off
+// never affects contexts already saved, which are still unwound and released
+// as usual, and a C->Go call without a context only lacks its C frames.
+static bool shouldCapture(void) {
+    if (__atomic_load_n(&capture_mode, __ATOMIC_RELAXED) == CAPTURE_ALWAYS) {
+        return true;
+    }
+    if (capture_checks++ % CAPTURE_CHECK_INTERVAL == 0) {
+        __atomic_store_n(&capture_active, profilingActive(), __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&capture_active, __ATOMIC_RELAXED);
+}
+
+void async_cgo_traceback_set_capture_mode(int mode) {
+    __atomic_store_n(&capture_active, profilingActive(), __ATOMIC_RELAXED);
+    __atomic_store_n(&capture_mode, mode, __ATOMIC_RELAXED);
+}
+
+// Marks the start and end of a profile taken by other means than the runtime
+// CPU profiler. Calls nest.
+void async_cgo_traceback_profiler_started(void) {
+    __atomic_fetch_add(&profilers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&capture_active, 1, __ATOMIC_RELAXED);
+}
+
+void async_cgo_traceback_profiler_stopped(void) {
+    // capture_active is cleared by the next check if this was the last one
+    __atomic_fetch_sub(&profilers, 1, __ATOMIC_RELAXED);
+}
+
+void async_cgo_traceback_internal_set_stack_memo_enabled(int value) {
+    setStackMemoEnabled(value != 0);
+}
+
+void async_cgo_traceback_internal_stack_memo_stats(uint64_t *hits, uint64_t *misses) {
+    StackMemoStats stats;
+    getStackMemoStats(stats);
+    *hits = stats.hits;
+    *misses = stats.misses;
+}
+
+void async_cgo_traceback_internal_stack_read_stats(uint64_t *fallback, uint64_t *faults) {
+    StackReadStats stats;
+    getStackReadStats(stats);
+    *fallback = stats.fallback;
+    *faults = stats.faults;
+}
+
+// Selects the unwinder, one of the UnwindEngine values. Returns 0 if it
+// isn't supported.
+int async_cgo_traceback_set_unwinder(int engine) {
+    return Unwinder::setEngine((UnwindEngine) engine);
+}
+
+// Switches profiling signals to taking stack snapshots, which the
+// UnwindWorker unwinds, rather than unwinding in the signal handler. Returns 0
+// if snapshots aren't supported.
+int async_cgo_traceback_enable_stack_snapshots(int window) {
+    return StackSnapshots::enable(window);
+}
+
+void async_cgo_traceback_disable_stack_snapshots(void) {
+    StackSnapshots::disable();
+}
+
+// Copies the call stack of an unwound snapshot to buf, and the thread it was
+// taken on and when, in CLOCK_MONOTONIC nanoseconds, to tid and time. Returns
+// the number of frames, or -1 if there isn't one.
+int async_cgo_traceback_read_stack_snapshot(uintptr_t *buf, int max, int *tid, uint64_t *time) {
+    SnapshotSample sample;
+    int n = StackSnapshots::read(buf, max, &sample);
+    if (n >= 0) {
+        *tid = sample.tid;
+        *time = sample.time;
+    }
+    return n;
+}
+
+uint64_t async_cgo_traceback_monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void async_cgo_traceback_internal_stack_snapshot_stats(uint64_t *captured, uint64_t *dropped,
+                                                       uint64_t *unwound, uint64_t *bytes) {
+    StackSnapshotStats stats;
+    StackSnapshots::stats(stats);
+    *captured = stats.captured;
+    *dropped = stats.dropped;
+    *unwound = stats.unwound;
+    *bytes = stats.bytes;
+}
+
+void async_cgo_traceback_internal_set_unwind_cache_enabled(int value) {
+    setUnwindCacheEnabled(value != 0);
+}
+
+void async_cgo_traceback_internal_unwind_cache_stats(uint64_t *frame_hits, uint64_t *lib_hits, uint64_t *misses) {
+    UnwindCacheStats stats;
+    getUnwindCacheStats(stats);
+    *frame_hits = stats.frame_hits;
+    *lib_hits = stats.lib_hits;
+    *misses = stats.misses;
+}
+
+// The default and largest number of C frames unwound for a call stack. The
+// Go runtime takes at most RUNTIME_TRACEBACK_PCS of them for a traceback,
+// since its buffers (cgoCallers and the traceback's cgoBuf) hold 32 pcs, so
+// deeper settings only deepen the call stacks of stack snapshots.
+#define DEFAULT_MAX_DEPTH 32
+#define MAX_DEPTH_LIMIT 1024
+#define RUNTIME_TRACEBACK_PCS 32
+
+static int max_depth = DEFAULT_MAX_DEPTH;
+
+void async_cgo_traceback_set_max_depth(int depth) {
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MAX_DEPTH_LIMIT) {
+        depth = MAX_DEPTH_LIMIT;
+    }
+    __atomic_store_n(&max_depth, depth, __ATOMIC_RELAXED);
+}
+
+int async_cgo_traceback_max_depth(void) {
+    return __atomic_load_n(&max_depth, __ATOMIC_RELAXED);
+}
+
+// A context stores as many frames as the runtime takes for a traceback
+// itself, and any more, should the runtime ask for them, in a chain of blocks
+// from the overflow arena, so that idle contexts stay small however deep the
+// call stacks may be.
+#define STACK_INLINE RUNTIME_TRACEBACK_PCS
+#define OVERFLOW_BLOCK_PCS 62
+
+struct overflow_block {
+    // The next block of the context's chain
+    struct overflow_block *next;
+    // The index + 1 of the next block on the free list, or 0
+    uint64_t free_next;
+    uintptr_t pcs[OVERFLOW_BLOCK_PCS];
+};
+
+// The overflow arena is shared by all threads, and is lock-free, since a
+// signal handler may interrupt a thread in the middle of using it. Blocks are
+// numbered, and carved out of mmaped chunks in order by bumping a counter.
+// The first thread to need a chunk maps it. Released blocks go on a free
+// list, whose head holds the index of the top block along with a tag which
+// every push and pop increments, so that a pop's compare-and-swap fails if
+// the top block was popped and pushed back meanwhile.
+#define OVERFLOW_CHUNK_BYTES (64 * 1024)
+#define OVERFLOW_CHUNK_BLOCKS (OVERFLOW_CHUNK_BYTES / sizeof(struct overflow_block))
+#define OVERFLOW_MAX_CHUNKS 1024
+
+static struct overflow_block *overflow_chunks[OVERFLOW_MAX_CHUNKS];
+static uint64_t overflow_next_block = 0;
+// (tag << 32) | (index + 1) of the top block, or a tag alone if it's empty
+static uint64_t overflow_free = 0;
+
+static struct overflow_block *overflow_block_at(uint64_t index) {
+    struct overflow_block *chunk = __atomic_load_n(&overflow_chunks[index / OVERFLOW_CHUNK_BLOCKS], __ATOMIC_ACQUIRE);
+    return &chunk[index % OVERFLOW_CHUNK_BLOCKS];
+}
+
+static struct overflow_block *overflow_alloc(uint64_t *index) {
+    uint64_t head = __atomic_load_n(&overflow_free, __ATOMIC_ACQUIRE);
+    while ((uint32_t) head != 0) {
+        *index = (uint32_t) head - 1;
+        struct overflow_block *block = overflow_block_at(*index);
+        // Blocks are never unmapped, so this is safe to read even if the
+        // block was popped meanwhile, in which case the swap fails
+        uint64_t next = __atomic_load_n(&block->free_next, __ATOMIC_RELAXED);
+        uint64_t tagged = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&overflow_free, &head, tagged, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return block;
+        }
+    }
+
+    *index = __atomic_fetch_add(&overflow_next_block, 1, __ATOMIC_RELAXED);
+    uint64_t c = *index / OVERFLOW_CHUNK_BLOCKS;
+    if (c >= OVERFLOW_MAX_CHUNKS) {
+        return NULL;
+    }
+    if (__atomic_load_n(&overflow_chunks[c], __ATOMIC_ACQUIRE) == NULL) {
+        void *chunk = mmap(NULL, OVERFLOW_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            // The block is lost, but so is the rest of the arena
+            return NULL;
+        }
+        struct overflow_block *expected = NULL;
+        if (!__atomic_compare_exchange_n(&overflow_chunks[c], &expected, (struct overflow_block *) chunk, false,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            // Another thread mapped it first
+            munmap(chunk, OVERFLOW_CHUNK_BYTES);
+        }
+    }
+    return overflow_block_at(*index);
+}
+
+static void overflow_release(struct overflow_block *chain);
+
+// Stores pcs[0:n] in a new chain of blocks. Returns false, and stores
+// nothing, if the arena is out of memory.
+static bool overflow_store(struct overflow_block **chain, const uintptr_t *pcs, int n) {
+    *chain = NULL;
+    struct overflow_block **tail = chain;
+    int stored = 0;
+    while (stored < n) {
+        uint64_t index;
+        struct overflow_block *block = overflow_alloc(&index);
+        if (block == NULL) {
+            overflow_release(*chain);
+            *chain = NULL;
+            return false;
+        }
+        // Until the block is released, free_next holds its own index
+        __atomic_store_n(&block->free_next, index + 1, __ATOMIC_RELAXED);
+        int count = n - stored < OVERFLOW_BLOCK_PCS ? n - stored : OVERFLOW_BLOCK_PCS;
+        memcpy(block->pcs, pcs + stored, count * sizeof(uintptr_t));
+        stored += count;
+        block->next = NULL;
+        *tail = block;
+        tail = &block->next;
+    }
+    return true;
+}
+
+static void overflow_release(struct overflow_block *chain) {
+    if (chain == NULL) {
+        return;
+    }
+    // Link the chain on the free list by index, then push it all at once
+    struct overflow_block *last = chain;
+    uint64_t first = chain->free_next;
+    while (last->next != NULL) {
+        struct overflow_block *next = last->next;
+        uint64_t next_index = next->free_next;
+        __atomic_store_n(&last->free_next, next_index, __ATOMIC_RELAXED);
+        last = next;
+    }
+    uint64_t head = __atomic_load_n(&overflow_free, __ATOMIC_RELAXED);
+    uint64_t tagged;
+    do {
+        __atomic_store_n(&last->free_next, (uint64_t) (uint32_t) head, __ATOMIC_RELAXED);
+        tagged = ((head >> 32) + 1) << 32 | first;
+    } while (!__atomic_compare_exchange_n(&overflow_free, &head, tagged, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
 struct cgo_context {
     const void *pc;
     uintptr_t sp;
     uintptr_t fp;
-    uintptr_t stack[STACK_MAX];
+    uintptr_t stack[STACK_INLINE];
+    // Where the return addresses in stack were read from
+    void **slots[STACK_INLINE];
+    struct overflow_block *overflow;
+    // The number of frames in stack and overflow
+    int depth;
     int cached;
-    int inuse;
+    // The stack was unwound for an earlier call from the same place, and
+    // must be checked before it's used
+    int reused;
+    // The unwinder recorded slots, so the stack can be reused
+    int verifiable;
+    // The next free context in the pool
+    struct cgo_context *next;
 };
 
-// There may be multiple C->Go transitions for a single C tread, so we have a
-// per-thread free list of contexts.
+// There may be multiple C->Go transitions for a single C thread, so each
+// thread has a pool of contexts, taken from a free list.
+//
+// Thread-local storage for the pool is safe. A context will be taken from the
+// pool when a C thread transitions to Go, and that context will be released
+// as soon as the Go call returns. Thus the thread that the context came from
+// will be alive the entire time the context is in use.
+//
+// The contexts are allocated on the first C->Go transition of a thread, so
+// that threads which never make one only pay for two pointers of TLS. The
+// pool grows by a page-sized slab at a time, allocated with mmap so that
+// growth is signal safe, and the slabs are unmapped when the thread exits.
 //
-// Thread-local storage for the context list is safe. A context will be taken
-// from the list when a C thread transitions to Go, and that context will be
-// released as soon as the Go call returns. Thus the thread that the context
-// came from will be alive the entire time the context is in use.
-#define cgo_contexts_length 256
-static __thread struct cgo_context cgo_contexts[cgo_contexts_length];
-
-// XXX: The runtime.SetCgoTraceback docs claim that cgo_context can be called
-// from a signal handler. I know in practice that doesn't happen but maybe it
-// could in the future. If so, can we make sure that accessing this list of
-// cgo_contexts is signal safe?
+// Contexts are released in the opposite order they're taken, since C->Go
+// calls nest. So if a signal handler takes and releases contexts while the
+// thread is in the middle of updating the free list, the list is the same
+// once the handler returns, and a compare-and-swap of the head is enough to
+// keep it consistent.
+#define CGO_CONTEXT_SLAB_BYTES 4096
+#define CGO_CONTEXT_SLAB_SIZE \
+    ((CGO_CONTEXT_SLAB_BYTES - sizeof(void *)) / sizeof(struct cgo_context))
+
+struct cgo_context_slab {
+    struct cgo_context_slab *next;
+    struct cgo_context contexts[CGO_CONTEXT_SLAB_SIZE];
+};
+
+// Each thread keeps the last few unwound contexts it released, so that a
+// later C->Go call from the same frame, i.e. with the same pc, sp and fp, can
+// reuse the unwound stack. This is common for C code which calls back into Go
+// in a loop. A reused stack is only used if the return addresses of all its
+// frames are still in place. Only the first STACK_INLINE frames record where
+// they were read from, so deeper stacks aren't kept.
+#define CGO_CALL_SITES 4
+
+struct cgo_call_sites {
+    struct cgo_context *contexts[CGO_CALL_SITES];
+    int next;
+    // Set while the table is updated, in which case a signal handler making
+    // a C->Go call doesn't use it
+    int busy;
+};
+
+struct cgo_context_pool {
+    struct cgo_context *free;
+    struct cgo_context_slab *slabs;
+    struct cgo_call_sites sites;
+};
+
+// Initial-exec, since the general dynamic model calls __tls_get_addr, which
+// isn't signal safe, when this is part of a dlopened c-shared library
+static __thread struct cgo_context_pool cgo_pool __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t cgo_pool_key;
+static pthread_once_t cgo_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void cgo_pool_destroy(void *p) {
+    struct cgo_context_pool *pool = (struct cgo_context_pool *) p;
+    for (int i = 0; i < CGO_CALL_SITES; i++) {
+        struct cgo_context *ctx = pool->sites.contexts[i];
+        if (ctx != NULL) {
+            overflow_release(ctx->overflow);
+            pool->sites.contexts[i] = NULL;
+        }
+    }
+    struct cgo_context_slab *slab = pool->slabs;
+    while (slab != NULL) {
+        struct cgo_context_slab *next = slab->next;
+        munmap(slab, sizeof(*slab));
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free = NULL;
+}
+
+static void cgo_pool_key_create(void) {
+    pthread_key_create(&cgo_pool_key, cgo_pool_destroy);
+}
+
+// Adds a slab of contexts to the pool's free list
+static bool cgo_pool_grow(struct cgo_context_pool *pool) {
+    void *p = mmap(NULL, sizeof(struct cgo_context_slab), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    struct cgo_context_slab *slab = (struct cgo_context_slab *) p;
+    for (size_t i = 0; i < CGO_CONTEXT_SLAB_SIZE - 1; i++) {
+        slab->contexts[i].next = &slab->contexts[i + 1];
+    }
+
+    struct cgo_context_slab *slabs = __atomic_load_n(&pool->slabs, __ATOMIC_RELAXED);
+    do {
+        slab->next = slabs;
+    } while (!__atomic_compare_exchange_n(&pool->slabs, &slabs, slab, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    struct cgo_context *head = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    do {
+        slab->contexts[CGO_CONTEXT_SLAB_SIZE - 1].next = head;
+    } while (!__atomic_compare_exchange_n(&pool->free, &head, &slab->contexts[0], true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
 
 static struct cgo_context *cgo_context_get(void) {
-    for (int i = 0; i < cgo_contexts_length; i++) {
-        if (cgo_contexts[i].inuse == 0) {
-            cgo_contexts[i].inuse = 1;
-            cgo_contexts[i].cached = 0;
-            return &cgo_contexts[i];
+    struct cgo_context_pool *pool = &cgo_pool;
+    if (pool->slabs == NULL) {
+        // Register the pool to be freed when the thread exits. Not signal
+        // safe, but this only happens on the first C->Go transition.
+        pthread_once(&cgo_pool_key_once, cgo_pool_key_create);
+        pthread_setspecific(cgo_pool_key, pool);
+    }
+    struct cgo_context *ctx = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    while (true) {
+        if (ctx == NULL) {
+            if (!cgo_pool_grow(pool)) {
+                return NULL;
+            }
+            ctx = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&pool->free, &ctx, ctx->next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            ctx->cached = 0;
+            ctx->reused = 0;
+            ctx->overflow = NULL;
+            return ctx;
         }
     }
-    return NULL;
 }
 
-static void cgo_context_release(struct cgo_context *c) {
-    c->inuse = 0;
+static void cgo_context_free(struct cgo_context *ctx) {
+    overflow_release(ctx->overflow);
+    ctx->overflow = NULL;
+    struct cgo_context_pool *pool = &cgo_pool;
+    struct cgo_context *head = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    do {
+        ctx->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->free, &head, ctx, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-// truncate_asmcgocall truncates a call stack after asmcgocall, if asmcgocall is
-// present in the stack. This function is the first function in the C call stack
-// for a Go -> C call, and it is not the responsibility of this library to
-// unwind past that function.
-static void truncate_asmcgocall(void **stack, int size) {
-    if (asmcgocall_bounds == nullptr) {
-        return;
+// for testing: counts the calling thread's contexts, and those which are free
+// or kept for their call site
+void async_cgo_traceback_internal_context_pool_stats(int *total, int *free, int *kept) {
+    struct cgo_context_pool *pool = &cgo_pool;
+    *total = 0;
+    for (struct cgo_context_slab *slab = pool->slabs; slab != NULL; slab = slab->next) {
+        *total += CGO_CONTEXT_SLAB_SIZE;
     }
-    for (int i = 0; i < size; i++) {
-        uintptr_t a = (uintptr_t) stack[i];
-        a += asmcgocall_base;
-        if ((a >= (uintptr_t) asmcgocall_bounds->_start) && (a <= (uintptr_t) asmcgocall_bounds->_end)) {
-            if ((i + 1) < size) {
-                // zero out the thing AFTER asmcgocall. We want to stop at
-                // asmcgocall since that's the "top" of the C stack in a
-                // Go -> C (-> Go) call
-                stack[i + 1] = 0;
-                return;
+    *free = 0;
+    for (struct cgo_context *ctx = pool->free; ctx != NULL; ctx = ctx->next) {
+        (*free)++;
+    }
+    *kept = 0;
+    for (int i = 0; i < CGO_CALL_SITES; i++) {
+        *kept += pool->sites.contexts[i] != NULL;
+    }
+}
+
+// for testing: stores, checks and releases chains of up to max_pcs in the
+// overflow arena, and returns how many didn't hold what was stored
+int async_cgo_traceback_internal_overflow_check(int iterations, int max_pcs) {
+    uintptr_t pcs[4 * OVERFLOW_BLOCK_PCS];
+    if (max_pcs > (int) (sizeof(pcs) / sizeof(pcs[0]))) {
+        max_pcs = sizeof(pcs) / sizeof(pcs[0]);
+    }
+    int bad = 0;
+    for (int i = 0; i < iterations; i++) {
+        int n = 1 + i % max_pcs;
+        for (int j = 0; j < n; j++) {
+            pcs[j] = (uintptr_t) &pcs[j] + i;
+        }
+        struct overflow_block *chain;
+        if (!overflow_store(&chain, pcs, n)) {
+            bad++;
+            continue;
+        }
+        int j = 0;
+        for (struct overflow_block *block = chain; block != NULL; block = block->next) {
+            for (int k = 0; k < OVERFLOW_BLOCK_PCS && j < n; k++, j++) {
+                if (block->pcs[k] != pcs[j]) {
+                    bad++;
+                    j = n;
+                    break;
+                }
             }
         }
+        overflow_release(chain);
     }
+    return bad;
+}
+
+// for testing: reports whether the calling thread's stack bounds are cached
+int async_cgo_traceback_internal_thread_stack_cached(void) {
+    return threadStackBoundsCached();
+}
+
+static bool call_site_reuse = true;
+
+void async_cgo_traceback_internal_set_call_site_reuse(int value) {
+    call_site_reuse = value != 0;
+}
+
+// Takes the context kept for a call from the frame in sc, if there is one
+static struct cgo_context *cgo_call_site_take(const StackContext &sc) {
+    struct cgo_call_sites *sites = &cgo_pool.sites;
+    if (!call_site_reuse || sites->busy) {
+        return NULL;
+    }
+    sites->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    struct cgo_context *found = NULL;
+    for (int i = 0; i < CGO_CALL_SITES; i++) {
+        struct cgo_context *ctx = sites->contexts[i];
+        if (ctx != NULL && ctx->pc == sc.pc && ctx->sp == sc.sp && ctx->fp == sc.fp) {
+            sites->contexts[i] = NULL;
+            ctx->reused = 1;
+            found = ctx;
+            break;
+        }
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    sites->busy = 0;
+    return found;
+}
+
+static void cgo_context_release(struct cgo_context *ctx) {
+    struct cgo_call_sites *sites = &cgo_pool.sites;
+    if (ctx->cached == 0 || ctx->verifiable == 0 || ctx->depth > STACK_INLINE || !call_site_reuse || sites->busy) {
+        cgo_context_free(ctx);
+        return;
+    }
+    sites->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    // Replace the context kept for the same frame, if any, or else the
+    // oldest one
+    int i = 0;
+    while (i < CGO_CALL_SITES) {
+        struct cgo_context *kept = sites->contexts[i];
+        if (kept != NULL && kept->pc == ctx->pc && kept->sp == ctx->sp && kept->fp == ctx->fp) {
+            break;
+        }
+        i++;
+    }
+    if (i == CGO_CALL_SITES) {
+        i = sites->next;
+        sites->next = (sites->next + 1) % CGO_CALL_SITES;
+    }
+    struct cgo_context *evicted = sites->contexts[i];
+    sites->contexts[i] = ctx;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    sites->busy = 0;
+    if (evicted != NULL) {
+        cgo_context_free(evicted);
+    }
+}
+
+// Unwinds the stack of the context into buf, and keeps a copy in the context.
+// If live is true, the context's frame is a caller of this call.
+static int cgo_context_walk(struct cgo_context *ctx, bool live, uintptr_t *buf, int depth) {
+    UnwindEngine engine = Unwinder::engine();
+    StackContext sc;
+    sc.pc = ctx->pc;
+    sc.sp = ctx->sp;
+    sc.fp = ctx->fp;
+    int n = Unwinder::walk(engine, readyLibraries(), sc, live, buf, depth, ctx->slots, STACK_INLINE);
+    int inline_n = n < STACK_INLINE ? n : STACK_INLINE;
+    memcpy(ctx->stack, buf, inline_n * sizeof(uintptr_t));
+    ctx->depth = n;
+    ctx->verifiable = Unwinder::recordsSlots(engine) && (live || Unwinder::walksSavedFrames(engine));
+    // Rather than keep a call stack cut short, the context is walked again
+    // for the next traceback
+    ctx->cached = overflow_store(&ctx->overflow, buf + inline_n, n - inline_n);
+    return n;
 }
 
 struct cgo_context_arg {
@@ -129,33 +753,52 @@ struct cgo_context_arg {
 };
 
 void async_cgo_context(void *p) {
-    if (enabled == 0) {
-        return;
-    }
-
     cgo_context_arg *arg = (cgo_context_arg *)p;
     struct cgo_context *ctx = (struct cgo_context *) arg->p;
+    // A context is released even if capture was turned off since it was saved
     if (ctx != NULL) {
         cgo_context_release(ctx);
         return;
     }
-    ctx = cgo_context_get();
-    if (ctx == NULL) {
+    if (enabled == 0 || !shouldCapture()) {
         return;
     }
+    // The context and any profiling signals during the call are unwound on
+    // this thread, so this is a good time to find its stack
+    cacheThreadStackBounds();
     StackContext sc;
     populateStackContext(sc, nullptr);
-    CodeCacheArray *cache = (CodeCacheArraySingleton::getInstance());
+    CodeCacheArray *cache = readyLibraries();
     // There are two frames in the call stack we should skip.  The first is this
     // function, and the second is _cgo_wait_runtime_init_done, which calls this
     // function to save the C call stack context before calling into Go code.
     // The next frame after that is the exported C->Go function, which is where
     // unwinding should begin for this context in the traceback function.
-    stepStackContext(sc, cache);
-    stepStackContext(sc, cache);
+    // Both frames are gone by the time the context is unwound, so they can't
+    // be skipped lazily, but they're the same for every call, so the frame
+    // descriptions found for them are reused.
+    skipFrames(sc, cache, 2);
+    ctx = cgo_call_site_take(sc);
+    if (ctx == NULL) {
+        ctx = cgo_context_get();
+    }
+    if (ctx == NULL) {
+        return;
+    }
     ctx->pc = sc.pc;
     ctx->sp = sc.sp;
     ctx->fp = sc.fp;
+    // Some unwinders can only unwind the stack while it's the caller's, so
+    // the context is unwound right away
+    if (ctx->cached == 0 && !Unwinder::walksSavedFrames(Unwinder::engine())) {
+        // The runtime never takes more frames than this
+        int depth = async_cgo_traceback_max_depth();
+        if (depth > RUNTIME_TRACEBACK_PCS) {
+            depth = RUNTIME_TRACEBACK_PCS;
+        }
+        uintptr_t buf[RUNTIME_TRACEBACK_PCS];
+        cgo_context_walk(ctx, true, buf, depth);
+    }
     arg->p = (uintptr_t) ctx;
     return;
 }
@@ -174,34 +817,76 @@ void async_cgo_traceback(void *p) {
 
     struct cgo_traceback_arg *arg = (struct cgo_traceback_arg *)p;
     struct cgo_context *ctx = NULL;
-    StackContext sc;
 
     // If we had a previous context, then we're being called to unwind some
     // previous C portion of a mixed C/Go call stack. We use the call stack
     // information saved in the context.
+    int depth = async_cgo_traceback_max_depth();
+    if ((uintptr_t) depth > arg->max) {
+        depth = (int) arg->max;
+    }
+
     if (arg->context != 0) {
         ctx = (struct cgo_context *) arg->context;
+        if (ctx->reused) {
+            // Only contexts with a slot for every frame are kept for reuse
+            if (!framesUnchanged(ctx->stack, ctx->slots, ctx->depth)) {
+                overflow_release(ctx->overflow);
+                ctx->overflow = NULL;
+                ctx->cached = 0;
+            }
+            ctx->reused = 0;
+        }
+        // The number of frames in the caller's buffer
+        int n;
         if (ctx->cached == 0) {
-            CodeCacheArray *cache = (CodeCacheArraySingleton::getInstance());
-            sc.pc = ctx->pc;
-            sc.sp = ctx->sp;
-            sc.fp = ctx->fp;
-            int n = stackWalk(cache, sc, ctx->stack, STACK_MAX, 0);
-            truncate_asmcgocall((void **) ctx->stack, n);
-            ctx->cached = 1;
-        }
-        uintptr_t n = (arg->max < STACK_MAX) ? arg->max : STACK_MAX;
-        memcpy(arg->buf, ctx->stack, n * sizeof(uintptr_t));
+            // Walk into the caller's buffer, and keep a copy in the context
+            n = cgo_context_walk(ctx, false, arg->buf, depth);
+        } else {
+            int want = ctx->depth < depth ? ctx->depth : depth;
+            int inline_n = want < STACK_INLINE ? want : STACK_INLINE;
+            memcpy(arg->buf, ctx->stack, inline_n * sizeof(uintptr_t));
+            n = inline_n;
+            for (struct overflow_block *block = ctx->overflow; block != NULL && n < want; block = block->next) {
+                int count = want - n < OVERFLOW_BLOCK_PCS ? want - n : OVERFLOW_BLOCK_PCS;
+                memcpy(arg->buf + n, block->pcs, count * sizeof(uintptr_t));
+                n += count;
+            }
+        }
+        if ((uintptr_t) n < arg->max) {
+            arg->buf[n] = 0;
+        }
         return;
     }
 
-    populateStackContext(sc, (void *) arg->sig_context);
-    CodeCacheArray *cache = (CodeCacheArraySingleton::getInstance());
-    int n = stackWalk(cache, sc, arg->buf, arg->max, 0);
+    // A signal traceback means a profiler is running, so start saving
+    // contexts right away rather than at the next check
+    if (arg->sig_context != 0) {
+        __atomic_store_n(&capture_active, 1, __ATOMIC_RELAXED);
+
+        // With snapshots, the sample only gets the interrupted pc, and the
+        // full call stack is read from the snapshot once it's unwound
+        SnapshotBuffer *snapshots = StackSnapshots::active();
+        if (snapshots != NULL) {
+            StackContext sc;
+            populateStackContext(sc, (void *) arg->sig_context);
+            if (snapshots->capture(sc)) {
+                UnwindWorker::wake();
+            }
+            if (arg->max > 0) {
+                arg->buf[0] = (uintptr_t) sc.pc;
+            }
+            if (arg->max > 1) {
+                arg->buf[1] = 0;
+            }
+            return;
+        }
+    }
+
+    int n = Unwinder::walkSignal(Unwinder::engine(), readyLibraries(), (void *) arg->sig_context, arg->buf, depth);
     if (n < arg->max) {
         arg->buf[n] = 0;
     }
-    truncate_asmcgocall((void **) arg->buf, n);
 
     return;
 }
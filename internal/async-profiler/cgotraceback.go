@@ -3,19 +3,93 @@ package asyncprofiler
 /*
 #cgo CXXFLAGS: -fno-omit-frame-pointer -g -O2 -std=c++11
 #cgo darwin CXXFLAGS: -D_XOPEN_SOURCE
+#cgo linux LDFLAGS: -lpthread -Wl,--wrap=pthread_create
+#cgo use_lazy_dwarf CXXFLAGS: -DCGOTRACEBACK_LAZY_DWARF
+#cgo use_ondemand_dwarf CXXFLAGS: -DCGOTRACEBACK_ONDEMAND_DWARF
+#cgo use_background_init CXXFLAGS: -DCGOTRACEBACK_BACKGROUND_INIT
+#cgo use_unwind_only CXXFLAGS: -DCGOTRACEBACK_UNWIND_ONLY
+
+#include <stdint.h>
 
 extern void async_cgo_context(void *);
 extern void async_cgo_traceback(void *);
+extern int async_cgo_traceback_ready(void);
+extern void async_cgo_traceback_add_stop_range(uintptr_t, uintptr_t);
+extern void async_cgo_traceback_set_max_depth(int);
+extern int async_cgo_traceback_set_unwinder(int);
+extern void async_cgo_traceback_set_capture_mode(int);
+extern void async_cgo_traceback_profiler_started(void);
+extern void async_cgo_traceback_profiler_stopped(void);
+extern int async_cgo_traceback_enable_stack_snapshots(int);
+extern void async_cgo_traceback_disable_stack_snapshots(void);
+extern int async_cgo_traceback_read_stack_snapshot(uintptr_t *, int, int *, uint64_t *);
+extern uint64_t async_cgo_traceback_monotonic_time(void);
+extern void *async_cgo_traceback_internal_return_address_func(void);
 extern void async_cgo_traceback_internal_set_enabled(int);
+extern void async_cgo_traceback_internal_set_unwind_cache_enabled(int);
+extern void async_cgo_traceback_internal_set_call_site_reuse(int);
+extern void async_cgo_traceback_internal_context_pool_stats(int *, int *, int *);
+extern int async_cgo_traceback_internal_overflow_check(int, int);
+extern int async_cgo_traceback_internal_thread_stack_cached(void);
+extern void async_cgo_traceback_internal_stack_read_stats(uint64_t *, uint64_t *);
+extern void async_cgo_traceback_internal_stack_snapshot_stats(uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+extern void async_cgo_traceback_internal_set_stack_memo_enabled(int);
+extern void async_cgo_traceback_internal_stack_memo_stats(uint64_t *, uint64_t *);
+extern void async_cgo_traceback_internal_unwind_cache_stats(uint64_t *, uint64_t *, uint64_t *);
 */
 import "C"
-import "unsafe"
+import (
+	"runtime"
+	"sort"
+	"unsafe"
+)
 
 var (
 	CgoContext   = unsafe.Pointer(C.async_cgo_context)
 	CgoTraceback = unsafe.Pointer(C.async_cgo_traceback)
 )
 
+//go:linkname asmcgocall runtime.asmcgocall
+//go:noescape
+func asmcgocall(fn, arg unsafe.Pointer) int32
+
+// maxAsmcgocallSize bounds the search for the end of runtime.asmcgocall
+const maxAsmcgocallSize = 4096
+
+func init() {
+	// The C part of a call stack for a Go->C call begins at asmcgocall, so
+	// unwinding stops there
+	start, end := asmcgocallBounds()
+	C.async_cgo_traceback_add_stop_range(C.uintptr_t(start), C.uintptr_t(end))
+}
+
+// asmcgocallBounds returns the address range of runtime.asmcgocall, where the
+// C part of a call stack for a Go->C call begins. It calls a C function
+// through asmcgocall to get a return address inside it, and finds the bounds
+// with the Go symbol table, which unlike the ELF symbols is never stripped.
+func asmcgocallBounds() (start, end uintptr) {
+	var pc uintptr
+	asmcgocall(C.async_cgo_traceback_internal_return_address_func(), unsafe.Pointer(&pc))
+	f := runtime.FuncForPC(pc)
+	if f == nil {
+		return 0, 0
+	}
+	start = f.Entry()
+	// The symbol table has no function sizes, so look for the first address
+	// which belongs to another function
+	size := sort.Search(maxAsmcgocallSize, func(i int) bool {
+		g := runtime.FuncForPC(pc + uintptr(i))
+		return g == nil || g.Entry() != start
+	})
+	return start, pc + uintptr(size)
+}
+
+// Ready reports whether the unwinder has finished parsing the loaded
+// libraries. Until then, call stacks are collected using frame pointers only.
+func Ready() bool {
+	return C.async_cgo_traceback_ready() != 0
+}
+
 func SetEnabled(status bool) {
 	var enabled C.int
 	if status {
@@ -23,3 +97,237 @@ func SetEnabled(status bool) {
 	}
 	C.async_cgo_traceback_internal_set_enabled(enabled)
 }
+
+// Unwinder is a way of unwinding C call stacks
+type Unwinder int
+
+// Unwinders, in the same order as the C++ UnwindEngine enum
+const (
+	// UnwinderDWARF uses the DWARF unwind tables of every library, and
+	// frame pointers where there are none
+	UnwinderDWARF Unwinder = iota
+	// UnwinderFramePointer only follows frame pointers
+	UnwinderFramePointer
+	// UnwinderGCC uses libgcc's _Unwind_Backtrace. It can only unwind from
+	// the frame calling it, so C->Go calls unwind their C call stack up
+	// front, and profiling signals use frame pointers instead.
+	UnwinderGCC
+)
+
+// SetUnwinder selects the unwinder for C call stacks. It returns false, and
+// leaves the unwinder as it was, if the unwinder isn't supported.
+func SetUnwinder(u Unwinder) bool {
+	return C.async_cgo_traceback_set_unwinder(C.int(u)) != 0
+}
+
+// SetMaxDepth sets the largest number of C frames collected for a call stack.
+// It is 32 by default and at most 1024. The Go runtime takes at most 32 C
+// frames for each part of a traceback or profile sample, so larger settings
+// only deepen the call stacks of stack snapshots.
+func SetMaxDepth(depth int) {
+	C.async_cgo_traceback_set_max_depth(C.int(depth))
+}
+
+// Context capture modes, in the same order as the C++ constants
+const (
+	captureAlways = iota
+	captureWhileProfiling
+)
+
+// SetCaptureWhileProfiling controls whether C->Go calls save the C call stack
+// context only while a profiler is running, rather than always. A profiler is
+// running while the runtime CPU profiler's timer is armed, or between calls to
+// ProfilerStarted and ProfilerStopped.
+func SetCaptureWhileProfiling(status bool) {
+	mode := captureAlways
+	if status {
+		mode = captureWhileProfiling
+	}
+	C.async_cgo_traceback_set_capture_mode(C.int(mode))
+}
+
+// ProfilerStarted marks the start of a profile which collects C call stacks
+// by other means than the runtime CPU profiler. Calls nest.
+func ProfilerStarted() {
+	C.async_cgo_traceback_profiler_started()
+}
+
+// ProfilerStopped marks the end of a profile started with ProfilerStarted
+func ProfilerStopped() {
+	C.async_cgo_traceback_profiler_stopped()
+}
+
+// SetCallSiteReuse controls whether a C->Go call reuses the unwound C call
+// stack of an earlier call from the same C frame. It is on by default.
+func SetCallSiteReuse(status bool) {
+	var enabled C.int
+	if status {
+		enabled = 1
+	}
+	C.async_cgo_traceback_internal_set_call_site_reuse(enabled)
+}
+
+// ContextPoolStats returns how many C->Go call contexts the calling thread
+// has, and how many of them are free or kept for reuse by their call site.
+// The rest are in use.
+func ContextPoolStats() (total, free, kept int) {
+	var t, f, k C.int
+	C.async_cgo_traceback_internal_context_pool_stats(&t, &f, &k)
+	return int(t), int(f), int(k)
+}
+
+// CheckOverflowArena stores, checks and releases iterations chains of up to
+// maxPCs frames in the arena which holds the frames contexts don't keep
+// inline, and returns how many didn't hold what was stored
+func CheckOverflowArena(iterations, maxPCs int) int {
+	return int(C.async_cgo_traceback_internal_overflow_check(C.int(iterations), C.int(maxPCs)))
+}
+
+// ThreadStackBoundsCached reports whether the calling thread's stack bounds
+// are cached, so that the unwinder reads its stack with plain loads
+func ThreadStackBoundsCached() bool {
+	return C.async_cgo_traceback_internal_thread_stack_cached() != 0
+}
+
+// SetUnwindCacheEnabled controls whether the unwinder uses its per-thread
+// cache of library and frame description lookups. It is on by default.
+func SetUnwindCacheEnabled(status bool) {
+	var enabled C.int
+	if status {
+		enabled = 1
+	}
+	C.async_cgo_traceback_internal_set_unwind_cache_enabled(enabled)
+}
+
+// UnwindCacheStats counts lookups in the unwinder's per-thread cache
+type UnwindCacheStats struct {
+	// FrameHits counts lookups where the frame description was cached
+	FrameHits uint64
+	// LibHits counts lookups where the library, but not the frame
+	// description, was cached
+	LibHits uint64
+	Misses  uint64
+}
+
+// GetUnwindCacheStats returns the total unwinder cache counts for all threads.
+// Counts are added to the totals in batches, so recent lookups may be missing.
+func GetUnwindCacheStats() UnwindCacheStats {
+	var frameHits, libHits, misses C.uint64_t
+	C.async_cgo_traceback_internal_unwind_cache_stats(&frameHits, &libHits, &misses)
+	return UnwindCacheStats{
+		FrameHits: uint64(frameHits),
+		LibHits:   uint64(libHits),
+		Misses:    uint64(misses),
+	}
+}
+
+// SetStackMemoEnabled controls whether signal tracebacks reuse the part of
+// the last call stack walked on the same thread which is unchanged. It is on
+// by default.
+func SetStackMemoEnabled(status bool) {
+	var enabled C.int
+	if status {
+		enabled = 1
+	}
+	C.async_cgo_traceback_internal_set_stack_memo_enabled(enabled)
+}
+
+// GetStackMemoStats returns how many memoized walks, for all threads, did and
+// didn't reuse part of the last call stack walked on their thread
+func GetStackMemoStats() (hits, misses uint64) {
+	var h, m C.uint64_t
+	C.async_cgo_traceback_internal_stack_memo_stats(&h, &m)
+	return uint64(h), uint64(m)
+}
+
+// StackReadStats counts reads from the stack by the unwinder, for all threads,
+// which weren't plain reads within the thread's known stack bounds
+type StackReadStats struct {
+	// Fallback counts reads outside the bounds, or on threads whose bounds
+	// aren't known, which recover from a fault if the address is bad
+	Fallback uint64
+	// Faults counts fallback reads which faulted
+	Faults uint64
+}
+
+// GetStackReadStats returns the total stack read counts. Counts are added to
+// the totals in batches, so recent reads may be missing.
+func GetStackReadStats() StackReadStats {
+	var fallback, faults C.uint64_t
+	C.async_cgo_traceback_internal_stack_read_stats(&fallback, &faults)
+	return StackReadStats{
+		Fallback: uint64(fallback),
+		Faults:   uint64(faults),
+	}
+}
+
+// EnableStackSnapshots makes CPU profile samples in C code copy the registers
+// and the top window bytes of the stack, rather than unwinding the C call
+// stack in the signal handler. The snapshots are unwound by a background
+// thread and read with ReadStackSnapshot, and the samples themselves only get
+// the interrupted instruction. The window is fixed by the first call, and is
+// 8192 bytes if it's 0. It returns false if snapshots aren't supported, which
+// is only on Linux.
+func EnableStackSnapshots(window int) bool {
+	return C.async_cgo_traceback_enable_stack_snapshots(C.int(window)) != 0
+}
+
+// DisableStackSnapshots goes back to unwinding C call stacks in the signal
+// handler. Snapshots already taken can still be read.
+func DisableStackSnapshots() {
+	C.async_cgo_traceback_disable_stack_snapshots()
+}
+
+// SnapshotSample identifies the CPU profile sample a snapshot was taken for
+type SnapshotSample struct {
+	// TID is the thread which was interrupted
+	TID int
+	// Time is when the snapshot was taken, in CLOCK_MONOTONIC nanoseconds,
+	// as returned by MonotonicTime
+	Time uint64
+}
+
+// ReadStackSnapshot copies the C call stack of an unwound snapshot to pcs,
+// and frees the snapshot. It returns the number of frames copied, the sample
+// the snapshot was taken for, and false if no snapshot has been unwound.
+// Snapshots aren't necessarily read in the order they were taken.
+func ReadStackSnapshot(pcs []uintptr) (int, SnapshotSample, bool) {
+	if len(pcs) == 0 {
+		return 0, SnapshotSample{}, false
+	}
+	var tid C.int
+	var time C.uint64_t
+	n := C.async_cgo_traceback_read_stack_snapshot((*C.uintptr_t)(unsafe.Pointer(&pcs[0])), C.int(len(pcs)), &tid, &time)
+	if n < 0 {
+		return 0, SnapshotSample{}, false
+	}
+	return int(n), SnapshotSample{TID: int(tid), Time: uint64(time)}, true
+}
+
+// MonotonicTime returns the current time in CLOCK_MONOTONIC nanoseconds
+func MonotonicTime() uint64 {
+	return uint64(C.async_cgo_traceback_monotonic_time())
+}
+
+// StackSnapshotStats counts stack snapshots since they were first enabled
+type StackSnapshotStats struct {
+	Captured uint64
+	// Dropped counts samples without a snapshot, since every snapshot for
+	// their CPU was waiting to be unwound or read
+	Dropped uint64
+	Unwound uint64
+	// Bytes counts the bytes of stack copied by signal handlers
+	Bytes uint64
+}
+
+// GetStackSnapshotStats returns the stack snapshot counts
+func GetStackSnapshotStats() StackSnapshotStats {
+	var captured, dropped, unwound, bytes C.uint64_t
+	C.async_cgo_traceback_internal_stack_snapshot_stats(&captured, &dropped, &unwound, &bytes)
+	return StackSnapshotStats{
+		Captured: uint64(captured),
+		Dropped:  uint64(dropped),
+		Unwound:  uint64(unwound),
+		Bytes:    uint64(bytes),
+	}
+}
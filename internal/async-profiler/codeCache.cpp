@@ -17,13 +17,18 @@
  * Modified by Nick Ripley to extract components needed for call stack unwinding
  */
 
+#include <algorithm>
 #include <stdint.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include "codeCache.h"
 #include "dwarf.h"
+#include "fdeCache.h"
 #include "os.h"
+#include "unwindTable.h"
+#include "unwindWorker.h"
 
 
 char* NativeFunc::create(const char* name, short lib_index) {
@@ -38,9 +43,12 @@ void NativeFunc::destroy(char* name) {
 }
 
 
-CodeCache::CodeCache(const char* name, short lib_index, const void* min_address, const void* max_address) {
+static uint64_t next_load_id = 1;
+
+CodeCache::CodeCache(const char* name, int lib_index, const void* min_address, const void* max_address) {
     _name = NativeFunc::create(name, -1);
     _lib_index = lib_index;
+    _load_id = __atomic_fetch_add(&next_load_id, 1, __ATOMIC_RELAXED);
     _min_address = min_address;
     _max_address = max_address;
     _text_base = NULL;
@@ -49,41 +57,86 @@ CodeCache::CodeCache(const char* name, short lib_index, const void* min_address,
     _got_end = NULL;
     _got_patchable = false;
 
-    _dwarf_table = NULL;
-    _dwarf_table_length = 0;
+    _eh_frame_hdr = NULL;
+    _unwind_table = NULL;
+    _dwarf_state = DWARF_NOT_PARSED;
+
+    _unwind_table_mapped = false;
+
+    _mappings = NULL;
+    _names = NULL;
 
-    _capacity = INITIAL_CODE_CACHE_CAPACITY;
+    _name_hash = NULL;
+    _name_hash_mask = 0;
+    _name_order = NULL;
+    _name_index_enabled = false;
+
+    // Allocated on the first add, since with SYMBOLS_NONE libraries have
+    // no symbols at all
+    _capacity = 0;
     _count = 0;
-    _blobs = new CodeBlob[_capacity];
+    _blobs = NULL;
 }
 
 CodeCache::~CodeCache() {
-    for (int i = 0; i < _count; i++) {
-        NativeFunc::destroy(_blobs[i]._name);
-    }
+    destroyNameIndex();
     NativeFunc::destroy(_name);
     delete[] _blobs;
-    free(_dwarf_table);
+    if (!_unwind_table_mapped) {
+        UnwindTable::destroy(_unwind_table);
+    }
+    while (_names != NULL) {
+        NameChunk* next = _names->next;
+        free(_names);
+        _names = next;
+    }
+    while (_mappings != NULL) {
+        Mapping* next = _mappings->next;
+        munmap(_mappings->addr, _mappings->size);
+        delete _mappings;
+        _mappings = next;
+    }
 }
 
 void CodeCache::expand() {
     CodeBlob* old_blobs = _blobs;
-    CodeBlob* new_blobs = new CodeBlob[_capacity * 2];
+    int new_capacity = _capacity == 0 ? INITIAL_CODE_CACHE_CAPACITY : _capacity * 2;
+    CodeBlob* new_blobs = new CodeBlob[new_capacity];
 
-    memcpy(new_blobs, old_blobs, _count * sizeof(CodeBlob));
+    if (_count > 0) {
+        memcpy(new_blobs, old_blobs, _count * sizeof(CodeBlob));
+    }
 
-    _capacity *= 2;
+    _capacity = new_capacity;
     _blobs = new_blobs;
     delete[] old_blobs;
 }
 
-void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
-    char* name_copy = NativeFunc::create(name, _lib_index);
-    // Replace non-printable characters
-    for (char* s = name_copy; *s != 0; s++) {
-        if (*s < ' ') *s = '?';
+// Copies a name into the name arena, replacing non-printable characters
+const char* CodeCache::copyName(const char* name) {
+    size_t size = strlen(name) + 1;
+    if (_names == NULL || _names->capacity - _names->used < size) {
+        // Start small, since most libraries only copy a few PLT stub names
+        size_t capacity = _names == NULL ? MIN_NAME_CHUNK_SIZE : _names->capacity * 2;
+        if (capacity > MAX_NAME_CHUNK_SIZE) capacity = MAX_NAME_CHUNK_SIZE;
+        if (capacity < size) capacity = size;
+        NameChunk* chunk = (NameChunk*)malloc(sizeof(NameChunk) + capacity);
+        chunk->next = _names;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        _names = chunk;
     }
 
+    char* copy = _names->data + _names->used;
+    _names->used += size;
+    for (size_t i = 0; i < size; i++) {
+        copy[i] = name[i] != 0 && name[i] < ' ' ? '?' : name[i];
+    }
+    return copy;
+}
+
+void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
+    destroyNameIndex();
     if (_count >= _capacity) {
         expand();
     }
@@ -91,7 +144,7 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     const void* end = (const char*)start + length;
     _blobs[_count]._start = start;
     _blobs[_count]._end = end;
-    _blobs[_count]._name = name_copy;
+    _blobs[_count]._name = copyName(name);
     _count++;
 
     if (update_bounds) {
@@ -99,6 +152,50 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     }
 }
 
+void CodeCache::addMapped(const void* start, int length, const char* name) {
+    destroyNameIndex();
+    if (_count >= _capacity) {
+        expand();
+    }
+
+    _blobs[_count]._start = start;
+    _blobs[_count]._end = (const char*)start + length;
+    _blobs[_count]._name = name;
+    _count++;
+}
+
+void CodeCache::addMapping(void* addr, size_t size) {
+    Mapping* mapping = new Mapping;
+    mapping->addr = addr;
+    mapping->size = size;
+    mapping->next = _mappings;
+    _mappings = mapping;
+}
+
+const char* CodeCache::blobName(CodeBlob* blob) {
+    for (const char* s = blob->_name; *s != 0; s++) {
+        if (*s < ' ') {
+            blob->_name = copyName(blob->_name);
+            break;
+        }
+    }
+    return blob->_name;
+}
+
+size_t CodeCache::symbolMemory() const {
+    size_t size = _capacity * sizeof(CodeBlob);
+    for (NameChunk* chunk = _names; chunk != NULL; chunk = chunk->next) {
+        size += sizeof(NameChunk) + chunk->capacity;
+    }
+    if (_name_hash != NULL) {
+        size += (_name_hash_mask + 1) * sizeof(uint32_t);
+    }
+    if (_name_order != NULL) {
+        size += _count * sizeof(uint32_t);
+    }
+    return size;
+}
+
 void CodeCache::updateBounds(const void* start, const void* end) {
     if (start < _min_address) _min_address = start;
     if (end > _max_address) _max_address = end;
@@ -109,19 +206,85 @@ void CodeCache::sort() {
 
     qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
 
+    // Symbols are only added while parsing, so release the spare capacity
+    if (_count < _capacity) {
+        CodeBlob* blobs = new CodeBlob[_count];
+        memcpy(blobs, _blobs, _count * sizeof(CodeBlob));
+        delete[] _blobs;
+        _blobs = blobs;
+        _capacity = _count;
+    }
+
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
     if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
+
+    destroyNameIndex();
 }
 
-void CodeCache::mark(NamePredicate predicate) {
+// FNV-1a
+static uint32_t hashName(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char* s = (const unsigned char*)name; *s != 0; s++) {
+        h = (h ^ *s) * 16777619u;
+    }
+    return h;
+}
+
+struct NameOrder {
+    const CodeBlob* blobs;
+
+    // Ties are broken by address, so the first match is also the lowest
+    bool operator()(uint32_t a, uint32_t b) const {
+        int c = strcmp(blobs[a]._name, blobs[b]._name);
+        return c != 0 ? c < 0 : a < b;
+    }
+};
+
+void CodeCache::buildNameIndex() {
+    // At most 3/4 full, so probe sequences stay short
+    uint32_t size = 1;
+    while (size < (uint32_t)_count + _count / 3 + 1) {
+        size <<= 1;
+    }
+    _name_hash = (uint32_t*)calloc(size, sizeof(uint32_t));
+    if (_name_hash == NULL) {
+        return;
+    }
+    _name_hash_mask = size - 1;
+
+    // Inserting in address order means that a probe for a duplicated name
+    // finds the lowest address first, as the linear scan would
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
-        if (blob_name != NULL && predicate(blob_name)) {
-            NativeFunc::mark(blob_name);
+        uint32_t slot = hashName(_blobs[i]._name) & _name_hash_mask;
+        while (_name_hash[slot] != 0) {
+            slot = (slot + 1) & _name_hash_mask;
         }
+        _name_hash[slot] = i + 1;
     }
 }
 
+// Sorting by name costs far more than hashing, so it's only done once a
+// prefix lookup needs it
+void CodeCache::buildNameOrder() {
+    _name_order = (uint32_t*)malloc(_count * sizeof(uint32_t));
+    if (_name_order == NULL) {
+        return;
+    }
+    for (int i = 0; i < _count; i++) {
+        _name_order[i] = i;
+    }
+    NameOrder order = {_blobs};
+    std::sort(_name_order, _name_order + _count, order);
+}
+
+void CodeCache::destroyNameIndex() {
+    free(_name_hash);
+    free(_name_order);
+    _name_hash = NULL;
+    _name_order = NULL;
+    _name_hash_mask = 0;
+}
+
 CodeBlob* CodeCache::find(const void* address) {
     for (int i = 0; i < _count; i++) {
         if (address >= _blobs[i]._start && address < _blobs[i]._end) {
@@ -142,19 +305,32 @@ const char* CodeCache::binarySearch(const void* address) {
         } else if (_blobs[mid]._start > address) {
             high = mid - 1;
         } else {
-            return _blobs[mid]._name;
+            return blobName(&_blobs[mid]);
         }
     }
 
     // Symbols with zero size can be valid functions: e.g. ASM entry points or kernel code.
     // Also, in some cases (endless loop) the return address may point beyond the function.
     if (low > 0 && (_blobs[low - 1]._start == _blobs[low - 1]._end || _blobs[low - 1]._end == address)) {
-        return _blobs[low - 1]._name;
+        return blobName(&_blobs[low - 1]);
     }
     return _name;
 }
 
 const void* CodeCache::findSymbol(const char* name) {
+    if (_name_hash == NULL && _name_index_enabled && _count >= MIN_NAME_INDEX_SYMBOLS) {
+        buildNameIndex();
+    }
+    if (_name_hash != NULL) {
+        uint32_t slot = hashName(name) & _name_hash_mask;
+        for (uint32_t i; (i = _name_hash[slot]) != 0; slot = (slot + 1) & _name_hash_mask) {
+            if (strcmp(_blobs[i - 1]._name, name) == 0) {
+                return _blobs[i - 1]._start;
+            }
+        }
+        return NULL;
+    }
+
     for (int i = 0; i < _count; i++) {
         const char* blob_name = _blobs[i]._name;
         if (blob_name != NULL && strcmp(blob_name, name) == 0) {
@@ -169,6 +345,43 @@ const void* CodeCache::findSymbolByPrefix(const char* prefix) {
 }
 
 const void* CodeCache::findSymbolByPrefix(const char* prefix, int prefix_len) {
+    if (_name_order == NULL && _name_index_enabled && _count >= MIN_NAME_INDEX_SYMBOLS) {
+        buildNameOrder();
+    }
+    if (_name_order != NULL) {
+        // Find the first name not ordered before the prefix. Every name
+        // starting with the prefix comes after it.
+        int low = 0;
+        int high = _count;
+        while (low < high) {
+            int mid = (unsigned int)(low + high) >> 1;
+            if (strncmp(_blobs[_name_order[mid]]._name, prefix, prefix_len) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        // And the first name ordered after the names with the prefix
+        int end = _count;
+        for (int l = low; l < end; ) {
+            int mid = (unsigned int)(l + end) >> 1;
+            if (strncmp(_blobs[_name_order[mid]]._name, prefix, prefix_len) <= 0) {
+                l = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+        // The blobs are sorted by address, so the lowest index of the names
+        // with the prefix is the match the scan below would find
+        uint32_t first = (uint32_t)_count;
+        for (int i = low; i < end; i++) {
+            if (_name_order[i] < first) {
+                first = _name_order[i];
+            }
+        }
+        return first < (uint32_t)_count ? _blobs[first]._start : NULL;
+    }
+
     for (int i = 0; i < _count; i++) {
         const char* blob_name = _blobs[i]._name;
         if (blob_name != NULL && strncmp(blob_name, prefix, prefix_len) == 0) {
@@ -204,32 +417,246 @@ void CodeCache::makeGotPatchable() {
 }
 
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
-    _dwarf_table = table;
-    _dwarf_table_length = length;
+    // Publish the table only once it's complete, since a signal handler may
+    // be looking for it concurrently
+    __atomic_store_n(&_unwind_table, UnwindTable::build(table, length), __ATOMIC_RELEASE);
+    __atomic_store_n(&_dwarf_state, DWARF_PARSED, __ATOMIC_RELEASE);
+    free(table);
+}
+
+void CodeCache::setMappedUnwindTable(const UnwindTable* table) {
+    _unwind_table_mapped = true;
+    __atomic_store_n(&_unwind_table, (UnwindTable*)table, __ATOMIC_RELEASE);
+    __atomic_store_n(&_dwarf_state, DWARF_PARSED, __ATOMIC_RELEASE);
 }
 
-FrameDesc* CodeCache::findFrameDesc(const void* pc) {
+void CodeCache::parseDwarfTable() {
+    if (_eh_frame_hdr == NULL || _text_base == NULL || _dwarf_state == DWARF_PARSED) {
+        return;
+    }
+    DwarfParser dwarf(_name, _text_base, _eh_frame_hdr);
+    setDwarfTable(dwarf.table(), dwarf.count());
+}
+
+// Asks the UnwindWorker to build the unwind table, if there is one to build.
+// Signal safe.
+void CodeCache::requestDwarfTable() {
+    if (_eh_frame_hdr == NULL) {
+        return;
+    }
+    int expected = DWARF_NOT_PARSED;
+    if (__atomic_compare_exchange_n(&_dwarf_state, &expected, DWARF_REQUESTED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        UnwindWorker::wake();
+    }
+}
+
+bool CodeCache::findFrameDesc(const void* pc, FrameDesc& frame) {
+    const void* start;
+    const void* end;
+    return findFrameDesc(pc, frame, &start, &end);
+}
+
+bool CodeCache::findFrameDesc(const void* pc, FrameDesc& frame, const void** start, const void** end) {
     u32 target_loc = (const char*)pc - _text_base;
-    int low = 0;
-    int high = _dwarf_table_length - 1;
+    u32 loc_start, loc_end;
+
+    UnwindTable* table = __atomic_load_n(&_unwind_table, __ATOMIC_ACQUIRE);
+    if (table != NULL) {
+        FrameDesc* f = table->find(target_loc, &loc_start, &loc_end);
+        if (f == NULL) {
+            return false;
+        }
+        frame = *f;
+    } else if (_dwarf_state == DWARF_ON_DEMAND) {
+        if (!FdeCache::findFrameDesc(_load_id, _text_base, _eh_frame_hdr, target_loc, frame, &loc_start, &loc_end)) {
+            return false;
+        }
+    } else {
+        // The caller falls back to frame pointers until the table is built
+        requestDwarfTable();
+        return false;
+    }
+
+    *start = _text_base + loc_start;
+    *end = _text_base + loc_end;
+    return true;
+}
+
+int CodeCacheIndex::Range::comparator(const void* r1, const void* r2) {
+    const Range* a = (const Range*)r1;
+    const Range* b = (const Range*)r2;
+    if (a->start < b->start) {
+        return -1;
+    } else if (a->start > b->start) {
+        return 1;
+    }
+    return 0;
+}
+
+CodeCacheIndex* CodeCacheIndex::build(CodeCache** libs, int count) {
+    CodeCacheIndex* index = (CodeCacheIndex*)malloc(sizeof(CodeCacheIndex) + count * sizeof(Range));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        CodeCache* cc = libs[i];
+        // Skip libraries whose bounds were never set
+        if (cc->minAddress() >= cc->maxAddress()) {
+            continue;
+        }
+        Range* r = &index->_ranges[index->_count++];
+        r->start = cc->minAddress();
+        r->end = cc->maxAddress();
+        r->lib = cc;
+    }
+
+    qsort(index->_ranges, index->_count, sizeof(Range), Range::comparator);
 
+    const void* reach = NO_MAX_ADDRESS;
+    for (int i = 0; i < index->_count; i++) {
+        if (index->_ranges[i].end > reach) {
+            reach = index->_ranges[i].end;
+        }
+        index->_ranges[i].reach = reach;
+    }
+    return index;
+}
+
+void CodeCacheIndex::destroy(CodeCacheIndex* index) {
+    free(index);
+}
+
+CodeCache* CodeCacheIndex::find(const void* address) const {
+    // Find the last range starting at or before the address
+    int low = 0;
+    int high = _count - 1;
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
+        if (_ranges[mid].start <= address) {
             low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
-            high = mid - 1;
         } else {
-            return &_dwarf_table[mid];
+            high = mid - 1;
         }
     }
 
-    if (low <= 0) {
-        return NULL;
+    // Library ranges normally don't overlap, in which case this checks
+    // exactly one range. Otherwise keep going back while an earlier range
+    // could still extend past the address.
+    for (int i = low - 1; i >= 0 && _ranges[i].reach > address; i--) {
+        if (address < _ranges[i].end) {
+            return _ranges[i].lib;
+        }
+    }
+    return NULL;
+}
+
+
+CodeCacheArray::CodeCacheArray() : _snapshot(NULL), _epoch(0) {
+    _readers[0] = _readers[1] = 0;
+    pthread_mutex_init(&_lock, NULL);
+    _snapshot = createSnapshot(0, 0);
+}
+
+CodeCacheArray::~CodeCacheArray() {
+    destroySnapshot(_snapshot);
+    pthread_mutex_destroy(&_lock);
+}
+
+CodeCacheArray::Snapshot* CodeCacheArray::createSnapshot(uint64_t generation, int count) {
+    Snapshot* snapshot = (Snapshot*)malloc(sizeof(Snapshot) + count * sizeof(CodeCache*));
+    if (snapshot != NULL) {
+        snapshot->generation = generation;
+        snapshot->count = count;
+        snapshot->index = NULL;
+    }
+    return snapshot;
+}
+
+void CodeCacheArray::destroySnapshot(Snapshot* snapshot) {
+    if (snapshot != NULL) {
+        CodeCacheIndex::destroy(snapshot->index);
+        free(snapshot);
+    }
+}
+
+CodeCacheArray::ReadGuard::ReadGuard(CodeCacheArray* array) : _array(array) {
+    while (true) {
+        int epoch = __atomic_load_n(&array->_epoch, __ATOMIC_SEQ_CST);
+        _slot = epoch & 1;
+        __atomic_fetch_add(&array->_readers[_slot], 1, __ATOMIC_SEQ_CST);
+        // If the epoch flipped in between, update() may have already checked
+        // this counter, so retry with the new one
+        if (__atomic_load_n(&array->_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return;
+        }
+        __atomic_fetch_sub(&array->_readers[_slot], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+CodeCacheArray::ReadGuard::~ReadGuard() {
+    __atomic_fetch_sub(&_array->_readers[_slot], 1, __ATOMIC_RELEASE);
+}
+
+// Waits until every reader which might have loaded the previous snapshot has
+// left its critical section
+void CodeCacheArray::synchronize() {
+    int old_slot = __atomic_fetch_add(&_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&_readers[old_slot], __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+}
+
+void CodeCacheArray::update(CodeCache** added, int added_count, CodeCache** removed, int removed_count) {
+    Snapshot* old = __atomic_load_n(&_snapshot, __ATOMIC_ACQUIRE);
+    Snapshot* snapshot = createSnapshot(old->generation + 1, old->count + added_count);
+    if (snapshot == NULL) {
+        return;
+    }
+
+    int count = 0;
+    for (int i = 0; i < old->count; i++) {
+        bool keep = true;
+        for (int j = 0; j < removed_count && keep; j++) {
+            keep = old->libs[i] != removed[j];
+        }
+        if (keep) {
+            snapshot->libs[count++] = old->libs[i];
+        }
+    }
+    for (int i = 0; i < added_count; i++) {
+        snapshot->libs[count++] = added[i];
+    }
+    snapshot->count = count;
+    // Without an index, find falls back to a linear scan
+    snapshot->index = CodeCacheIndex::build(snapshot->libs, count);
+
+    __atomic_store_n(&_snapshot, snapshot, __ATOMIC_SEQ_CST);
+    synchronize();
+
+    destroySnapshot(old);
+    for (int i = 0; i < removed_count; i++) {
+        delete removed[i];
     }
-    FrameDesc *f = &_dwarf_table[low - 1];
-    if (target_loc > f->loc_end) {
+}
+
+CodeCache* CodeCacheArray::find(const void* address, uint64_t* generation) {
+    Snapshot* snapshot = __atomic_load_n(&_snapshot, __ATOMIC_ACQUIRE);
+    if (snapshot == NULL) {
         return NULL;
     }
-    return f;
+    if (generation != NULL) {
+        *generation = snapshot->generation;
+    }
+
+    if (snapshot->index != NULL) {
+        return snapshot->index->find(address);
+    }
+    for (int i = 0; i < snapshot->count; i++) {
+        if (snapshot->libs[i]->contains(address)) {
+            return snapshot->libs[i];
+        }
+    }
+    return NULL;
 }
@@ -17,16 +17,20 @@
 #ifndef _CODECACHE_H
 #define _CODECACHE_H
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 //#include <jvmti.h>
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
 #define NO_MAX_ADDRESS  ((const void*)0)
 
-typedef bool (*NamePredicate)(const char* name);
-
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
-const int MAX_NATIVE_LIBS = 2048;
+const size_t MIN_NAME_CHUNK_SIZE = 4 * 1024;
+const size_t MAX_NAME_CHUNK_SIZE = 64 * 1024;
+// Below this many symbols, a linear scan is as fast as the name indexes
+const int MIN_NAME_INDEX_SYMBOLS = 64;
 
 
 class NativeFunc {
@@ -58,11 +62,14 @@ class NativeFunc {
 };
 
 
+// A symbol. The name isn't owned by the blob: it points into a mapping owned
+// by the CodeCache, into the loaded image, or into the CodeCache's name arena.
+// Names read from a mapping haven't been sanitized, see CodeCache::blobName.
 class CodeBlob {
   public:
     const void* _start;
     const void* _end;
-    char* _name;
+    const char* _name;
 
     static int comparator(const void* c1, const void* c2) {
         CodeBlob* cb1 = (CodeBlob*)c1;
@@ -80,12 +87,16 @@ class CodeBlob {
 };
 
 
-class FrameDesc;
+struct FrameDesc;
+class UnwindTable;
 
 class CodeCache {
   protected:
     char* _name;
-    short _lib_index;
+    int _lib_index;
+    // Unique among all the CodeCaches ever created, so that a library loaded
+    // where an unloaded one used to be is never mistaken for it
+    uint64_t _load_id;
     const void* _min_address;
     const void* _max_address;
     const char* _text_base;
@@ -94,18 +105,60 @@ class CodeCache {
     void** _got_end;
     bool _got_patchable;
 
-    FrameDesc* _dwarf_table;
-    int _dwarf_table_length;
+    const char* _eh_frame_hdr;
+    UnwindTable* _unwind_table;
+    int _dwarf_state;
+
+    bool _unwind_table_mapped;
+
+    // Files which symbol names or the unwind table point into
+    struct Mapping {
+        void* addr;
+        size_t size;
+        Mapping* next;
+    };
+    Mapping* _mappings;
+
+    // Storage for names which don't come from a mapping
+    struct NameChunk {
+        NameChunk* next;
+        size_t used;
+        size_t capacity;
+        char data[0];
+    };
+    NameChunk* _names;
+
+    // Name indexes, dropped by add and sort, and only built if enabled.
+    // _name_hash is an open addressing hash table of blob indices plus one,
+    // for exact lookups, built by the first one. _name_order has the blob
+    // indices sorted by name, for prefix lookups, and is built by the first
+    // one.
+    uint32_t* _name_hash;
+    uint32_t _name_hash_mask;
+    uint32_t* _name_order;
+    bool _name_index_enabled;
 
     int _capacity;
     int _count;
     CodeBlob* _blobs;
 
     void expand();
+    void requestDwarfTable();
+    const char* copyName(const char* name);
+    void buildNameIndex();
+    void buildNameOrder();
+    void destroyNameIndex();
+
+    enum {
+        DWARF_NOT_PARSED,
+        DWARF_REQUESTED,
+        DWARF_PARSED,
+        DWARF_ON_DEMAND
+    };
 
   public:
     CodeCache(const char* name,
-              short lib_index = -1,
+              int lib_index = -1,
               const void* min_address = NO_MIN_ADDRESS,
               const void* max_address = NO_MAX_ADDRESS);
 
@@ -143,14 +196,83 @@ class CodeCache {
         return _got_end;
     }
 
+    void setEhFrameHdr(const char* eh_frame_hdr) {
+        _eh_frame_hdr = eh_frame_hdr;
+    }
+
+    const char* ehFrameHdr() const {
+        return _eh_frame_hdr;
+    }
+
+    uint64_t loadId() const {
+        return _load_id;
+    }
+
+    const UnwindTable* unwindTable() const {
+        return __atomic_load_n(&_unwind_table, __ATOMIC_ACQUIRE);
+    }
+
+    // Whether an unwind hit this library before its unwind table was built
+    bool dwarfTableRequested() const {
+        return __atomic_load_n(&_dwarf_state, __ATOMIC_ACQUIRE) == DWARF_REQUESTED;
+    }
+
+    // Builds the unwind table from the .eh_frame_hdr section. Not signal safe.
+    void parseDwarfTable();
+
+    // Never builds an unwind table, and instead decodes frame descriptions
+    // from .eh_frame_hdr on each lookup, through the FdeCache
+    void setDwarfOnDemand() {
+        _dwarf_state = DWARF_ON_DEMAND;
+    }
+
+    // Uses a table from a mapping, which must be owned by this CodeCache or
+    // outlive it
+    void setMappedUnwindTable(const UnwindTable* table);
+
+    // Takes ownership of a read-only file mapping, which is unmapped when
+    // the CodeCache is destroyed
+    void addMapping(void* addr, size_t size);
+
+    int count() const {
+        return _count;
+    }
+
+    const CodeBlob* blobs() const {
+        return _blobs;
+    }
+
+    // Bytes allocated for the symbols, including copied names but not names
+    // in mappings, which are shared through the page cache
+    size_t symbolMemory() const;
+
+    // Adds a symbol with a copy of the name
     void add(const void* start, int length, const char* name, bool update_bounds = false);
+    // Adds a symbol referring to the name in place, which must be in a
+    // mapping owned by this CodeCache or outlive it
+    void addMapped(const void* start, int length, const char* name);
     void updateBounds(const void* start, const void* end);
+    // Sorts the symbols by address
     void sort();
-    void mark(NamePredicate predicate);
+
+    // Whether lookups by name build indexes the first time they're needed.
+    // Building them reads every name, which only pays off for a library
+    // searched many times, so it's off by default.
+    void setNameIndexEnabled(bool enabled) {
+        _name_index_enabled = enabled;
+    }
+
+    // Returns the blob's name, replacing non-printable characters. Names
+    // from mappings are copied the first time they need it. Not signal safe.
+    const char* blobName(CodeBlob* blob);
 
     CodeBlob* find(const void* address);
     const char* binarySearch(const void* address);
+    // Returns the lowest address of a symbol with the given name
     const void* findSymbol(const char* name);
+    // Returns the lowest address of a symbol starting with the given prefix.
+    // With the name index, the first call sorts the names, so this isn't
+    // signal safe.
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
 
@@ -158,33 +280,125 @@ class CodeCache {
     void** findGlobalOffsetEntry(void* address);
     void makeGotPatchable();
 
+    // Compacts the table into an UnwindTable, taking ownership of it
     void setDwarfTable(FrameDesc* table, int length);
-    FrameDesc* findFrameDesc(const void* pc);
+    bool findFrameDesc(const void* pc, FrameDesc& frame);
+    // Also returns the range of addresses [start, end) that the frame
+    // description applies to
+    bool findFrameDesc(const void* pc, FrameDesc& frame, const void** start, const void** end);
 };
 
 
-class CodeCacheArray {
+// CodeCacheIndex is an immutable index of the address ranges of a set of
+// libraries, sorted by start address, so that the library containing an
+// address can be found with a binary search.
+class CodeCacheIndex {
   private:
-    CodeCache* _libs[MAX_NATIVE_LIBS];
+    struct Range {
+        const void* start;
+        const void* end;
+        // Highest end address of this range and every range before it,
+        // used to stop the backwards scan for overlapping ranges early
+        const void* reach;
+        CodeCache* lib;
+
+        static int comparator(const void* r1, const void* r2);
+    };
+
     int _count;
+    Range _ranges[0];
+
+  public:
+    static CodeCacheIndex* build(CodeCache** libs, int count);
+    static void destroy(CodeCacheIndex* index);
+
+    CodeCache* find(const void* address) const;
+};
+
+
+// CodeCacheArray is the set of loaded libraries. It is read from signal
+// handlers while libraries are added and removed, so readers see immutable
+// snapshots of it. update() publishes a new snapshot, then waits until no
+// reader can still be using the old one before freeing it along with any
+// removed libraries.
+//
+// Readers announce themselves with a ReadGuard, which increments one of two
+// counters chosen by the parity of the current epoch. update() flips the
+// epoch after publishing, so that new readers use the other counter, and
+// waits for the old counter to drop to zero. This never blocks readers.
+class CodeCacheArray {
+  private:
+    struct Snapshot {
+        // Incremented by every update, so that readers which remember
+        // libraries between guards can tell they may have been removed
+        uint64_t generation;
+        int count;
+        CodeCacheIndex* index;
+        CodeCache* libs[0];
+    };
+
+    Snapshot* _snapshot;
+    int _epoch;
+    int _readers[2];
+    pthread_mutex_t _lock;
+
+    static Snapshot* createSnapshot(uint64_t generation, int count);
+    static void destroySnapshot(Snapshot* snapshot);
+    void synchronize();
 
   public:
-    CodeCacheArray() : _count(0) {
+    CodeCacheArray();
+    ~CodeCacheArray();
+
+    // Marks a read side critical section. Every library found while the
+    // guard is alive stays valid until it is destroyed. Signal safe.
+    class ReadGuard {
+      private:
+        CodeCacheArray* _array;
+        int _slot;
+
+      public:
+        ReadGuard(CodeCacheArray* array);
+        ~ReadGuard();
+    };
+
+    // Serializes updates, and protects the libraries from removal for
+    // callers that use them outside of a ReadGuard, e.g. to parse them
+    void lock() {
+        pthread_mutex_lock(&_lock);
+    }
+
+    void unlock() {
+        pthread_mutex_unlock(&_lock);
     }
 
+    // The current libraries, for callers holding the lock or running before
+    // any concurrent update is possible
     CodeCache* operator[](int index) {
-        return _libs[index];
+        return __atomic_load_n(&_snapshot, __ATOMIC_ACQUIRE)->libs[index];
     }
 
+    // The snapshot is only NULL if this array is read by another static
+    // initializer before its constructor has run
     int count() {
-        return __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+        Snapshot* snapshot = __atomic_load_n(&_snapshot, __ATOMIC_ACQUIRE);
+        return snapshot != NULL ? snapshot->count : 0;
     }
 
-    void add(CodeCache* lib) {
-        int index = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
-        _libs[index] = lib;
-        __atomic_store_n(&_count, index + 1, __ATOMIC_RELEASE);
+    uint64_t generation() {
+        Snapshot* snapshot = __atomic_load_n(&_snapshot, __ATOMIC_ACQUIRE);
+        return snapshot != NULL ? snapshot->generation : 0;
     }
+
+    // Publishes a snapshot with the libraries added and without the ones
+    // removed, which are destroyed once no reader can be using them. The
+    // caller must hold the lock. Not signal safe.
+    void update(CodeCache** added, int added_count, CodeCache** removed, int removed_count);
+
+    // Returns the library containing the address, or NULL. Must be called
+    // with a ReadGuard or the lock held. Also returns the generation of the
+    // snapshot searched, if requested.
+    CodeCache* find(const void* address, uint64_t* generation = NULL);
 };
 
 #endif // _CODECACHE_H
@@ -0,0 +1,198 @@
+//go:build cgotraceback_bench && linux
+// +build cgotraceback_bench,linux
+
+package asyncprofiler
+
+import (
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+)
+
+// Without frame pointers, only the library's unwind table can get the walk
+// past libraryCall to its caller
+const dlopenLibrarySource = `
+#include <string.h>
+
+__attribute__((noinline)) int libraryCall(void (*callback)(void)) {
+	volatile char buf[256];
+	memset((char *)buf, 1, sizeof(buf));
+	callback();
+	return buf[3];
+}
+`
+
+func buildLibrary(t *testing.T, name string) string {
+	return buildLibrarySource(t, name, dlopenLibrarySource)
+}
+
+func buildLibrarySource(t *testing.T, name, source string) string {
+	cc := strings.Fields(os.Getenv("CC"))
+	if len(cc) == 0 {
+		out, err := exec.Command("go", "env", "CC").Output()
+		if err != nil {
+			t.Skipf("no C compiler: %v", err)
+		}
+		cc = strings.Fields(string(out))
+	}
+	dir := t.TempDir()
+	src := filepath.Join(dir, name+".c")
+	lib := filepath.Join(dir, name+".so")
+	if err := os.WriteFile(src, []byte(source), 0644); err != nil {
+		t.Fatal(err)
+	}
+	args := append(cc[1:], "-O2", "-fomit-frame-pointer", "-shared", "-fPIC", "-o", lib, src)
+	if out, err := exec.Command(cc[0], args...).CombinedOutput(); err != nil {
+		t.Skipf("can't build the library: %v\n%s", err, out)
+	}
+	return lib
+}
+
+func TestUnwindLibraryLoadedLater(t *testing.T) {
+	// Each pass loads a new library, so the second one is found after the
+	// first was unloaded
+	for _, name := range []string{"first", "second"} {
+		lib, ok := openBenchLibrary(buildLibrary(t, name), "libraryCall")
+		if !ok {
+			t.Fatalf("can't load the %s library", name)
+		}
+		// The first walks through the library miss it, which asks the
+		// UnwindWorker to look for new libraries
+		if !poll(lib.walkThrough) {
+			lib.close()
+			t.Fatalf("walks never unwound the %s library loaded after init", name)
+		}
+		if !closeLibrary(lib) {
+			t.Fatalf("the %s library was never dropped after dlclose", name)
+		}
+	}
+}
+
+// closeLibrary unloads the library, and reports whether the unwinder dropped
+// it, which the worker does on its next periodic check. Other tests read the
+// unwind tables of every library the unwinder has, so they can't run until
+// it's gone.
+func closeLibrary(lib benchLibrary) bool {
+	lib.close()
+	return poll(func() bool {
+		_, known := lib.name()
+		return !known
+	})
+}
+
+func TestLibraryOpenedByRelativePath(t *testing.T) {
+	path, err := filepath.EvalSymlinks(buildLibrary(t, "relative"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	wd, err := os.Getwd()
+	if err != nil {
+		t.Fatal(err)
+	}
+	// The loader keeps the relative name, which means nothing once the
+	// working directory changes
+	if err := os.Chdir(filepath.Dir(path)); err != nil {
+		t.Fatal(err)
+	}
+	lib, ok := openBenchLibrary("./"+filepath.Base(path), "libraryCall")
+	if err := os.Chdir(wd); err != nil {
+		t.Fatal(err)
+	}
+	if !ok {
+		t.Fatal("can't load the library")
+	}
+	defer func() {
+		if !closeLibrary(lib) {
+			t.Error("the library was never dropped after dlclose")
+		}
+	}()
+
+	if !poll(lib.walkThrough) {
+		t.Fatal("walks never unwound the library")
+	}
+	if name, _ := lib.name(); name != path {
+		t.Errorf("library is named %q, want %q", name, path)
+	}
+}
+
+// libraryCallBytes is how much of libraryCall the tests below look up frame
+// descriptions for, which is all of it or close
+const libraryCallBytes = 64
+
+func TestOnDemandFramesAfterDlclose(t *testing.T) {
+	lib, ok := openBenchLibrary(buildLibrary(t, "unloaded"), "libraryCall")
+	if !ok {
+		t.Fatal("can't load the library")
+	}
+	frames := newLibraryFrames(dwarfOnDemand)
+	defer frames.close()
+	if _, found := frames.cfas(lib, libraryCallBytes); found == 0 {
+		lib.close()
+		t.Fatal("no frame descriptions for the library while it's loaded")
+	}
+
+	// Samples can still find the library until the worker's next check.
+	// Its sections are gone, so lookups must fail rather than fault.
+	lib.close()
+	if _, found := frames.cfas(lib, libraryCallBytes); found != 0 {
+		t.Errorf("%d frame descriptions for the library after dlclose", found)
+	}
+}
+
+func TestOnDemandFramesOfReloadedLibrary(t *testing.T) {
+	first, ok := openBenchLibrary(buildLibrary(t, "before"), "libraryCall")
+	if !ok {
+		t.Fatal("can't load the first library")
+	}
+	frames := newLibraryFrames(dwarfOnDemand)
+	if _, found := frames.cfas(first, libraryCallBytes); found == 0 {
+		t.Error("no frame descriptions for the first library")
+	}
+	frames.close()
+	first.close()
+
+	// A smaller frame, so that the FDE is likely at the same place but has
+	// different rows
+	source := strings.Replace(dlopenLibrarySource, "buf[256]", "buf[16]", 1)
+	second, ok := openBenchLibrary(buildLibrarySource(t, "after", source), "libraryCall")
+	if !ok {
+		t.Fatal("can't load the second library")
+	}
+	defer second.close()
+	if second.call != first.call {
+		t.Skip("the second library wasn't loaded where the first one was")
+	}
+
+	// The FdeCache still has the first library's rows
+	onDemand := newLibraryFrames(dwarfOnDemand)
+	defer onDemand.close()
+	eager := newLibraryFrames(dwarfEager)
+	defer eager.close()
+	got, _ := onDemand.cfas(second, libraryCallBytes)
+	want, found := eager.cfas(second, libraryCallBytes)
+	if found == 0 {
+		t.Fatal("no frame descriptions for the second library")
+	}
+	for i := range want {
+		// The table has no row for the start of the function, as it's the
+		// same as the previous function's last row, which ends before it
+		if want[i] != -1 && got[i] != want[i] {
+			t.Errorf("libraryCall+%d: on-demand CFA %#x, unwind table CFA %#x", i, got[i], want[i])
+		}
+	}
+}
+
+// poll reports whether f returned true within a few seconds
+func poll(f func() bool) bool {
+	deadline := time.Now().Add(5 * time.Second)
+	for !f() {
+		if time.Now().After(deadline) {
+			return false
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+	return true
+}
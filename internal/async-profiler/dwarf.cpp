@@ -18,7 +18,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "dwarf.h"
+#include "safeAccess.h"
 
 
 enum {
@@ -82,19 +84,116 @@ DwarfParser::DwarfParser(const char* name, const char* image_base, const char* e
     _table = (FrameDesc*)malloc(_capacity * sizeof(FrameDesc));
     _prev = NULL;
 
+    _fixed = false;
+    _past_target = false;
+    _target_loc = 0;
+
+    _checked = false;
+    _word_addr = NULL;
+    _word = 0;
+
     _code_align = sizeof(instruction_t);
     _data_align = -(int)sizeof(void*);
 
     parse(eh_frame_hdr);
 }
 
-void DwarfParser::parse(const char* eh_frame_hdr) {
+DwarfParser::DwarfParser(const char* image_base, const char* fde, u32 target_loc, FrameDesc* buffer, int capacity) {
+    _name = NULL;
+    _image_base = image_base;
+
+    _capacity = capacity;
+    _count = 0;
+    _table = buffer;
+    _prev = NULL;
+
+    _fixed = true;
+    _past_target = false;
+    _target_loc = target_loc;
+
+    _checked = true;
+    _word_addr = NULL;
+    _word = 0;
+
+    _code_align = sizeof(instruction_t);
+    _data_align = -(int)sizeof(void*);
+
+    _ptr = fde;
+    parseFde();
+}
+
+// Aligned words never cross a page boundary, so reading the one around ptr
+// only faults if ptr itself isn't mapped
+static const char* wordAddr(const char* ptr) {
+    return (const char*)((uintptr_t)ptr & ~(uintptr_t)(sizeof(void*) - 1));
+}
+
+static uintptr_t safeWord(const char* word_addr) {
+    return (uintptr_t)SafeAccess::load((void**)word_addr);
+}
+
+static int safeInt(const char* ptr) {
+    const char* word_addr = wordAddr(ptr);
+    size_t offset = ptr - word_addr;
+    uintptr_t words[2];
+    words[0] = safeWord(word_addr);
+    if (offset + sizeof(int) > sizeof(void*)) {
+        words[1] = safeWord(word_addr + sizeof(void*));
+    }
+    int value;
+    memcpy(&value, (const char*)words + offset, sizeof(int));
+    return value;
+}
+
+u8 DwarfParser::checkedByte(const char* ptr) {
+    const char* word_addr = wordAddr(ptr);
+    if (word_addr != _word_addr) {
+        _word = safeWord(word_addr);
+        _word_addr = word_addr;
+    }
+    return ((const u8*)&_word)[ptr - word_addr];
+}
+
+static bool supportedEhFrameHdr(const char* eh_frame_hdr) {
     u8 version = eh_frame_hdr[0];
     u8 eh_frame_ptr_enc = eh_frame_hdr[1];
     u8 fde_count_enc = eh_frame_hdr[2];
     u8 table_enc = eh_frame_hdr[3];
 
-    if (version != 1 || (eh_frame_ptr_enc & 0x7) != 0x3 || (fde_count_enc & 0x7) != 0x3 || (table_enc & 0xf7) != 0x33) {
+    return version == 1 && (eh_frame_ptr_enc & 0x7) == 0x3 && (fde_count_enc & 0x7) == 0x3 && (table_enc & 0xf7) == 0x33;
+}
+
+const char* DwarfParser::findFde(const char* image_base, const char* eh_frame_hdr, u32 target_loc) {
+    int header = safeInt(eh_frame_hdr);
+    if (!supportedEhFrameHdr((const char*)&header)) {
+        return NULL;
+    }
+
+    // The table is sorted pairs of (initial location, FDE address), both
+    // relative to the start of .eh_frame_hdr. parse() only needs the FDE
+    // addresses, so it starts reading 4 bytes later.
+    int fde_count = safeInt(eh_frame_hdr + 8);
+    const char* table = eh_frame_hdr + 12;
+    int low = 0;
+    int high = fde_count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        u32 loc = eh_frame_hdr + safeInt(table + mid * 8) - image_base;
+        if (loc <= target_loc) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (low <= 0) {
+        return NULL;
+    }
+    return eh_frame_hdr + safeInt(table + (low - 1) * 8 + 4);
+}
+
+void DwarfParser::parse(const char* eh_frame_hdr) {
+    if (!supportedEhFrameHdr(eh_frame_hdr)) {
         return;
     }
 
@@ -114,7 +213,7 @@ void DwarfParser::parseCie() {
 
     const char* cie_start = _ptr;
     _ptr += 5;
-    while (*_ptr++) {}
+    while (get8()) {}
     _code_align = getLeb();
     _data_align = getSLeb();
     _ptr = cie_start + cie_len;
@@ -335,16 +434,28 @@ int DwarfParser::parseExpression() {
 }
 
 void DwarfParser::addRecord(u32 loc, u32 loc_end, u32 cfa_reg, int cfa_off, int fp_off) {
+    if (_past_target) {
+        return;
+    }
     int cfa = cfa_reg | cfa_off << 8;
     if (_prev == NULL || (_prev->loc == loc && --_count >= 0) || _prev->cfa != cfa || _prev->fp_off != fp_off) {
         _prev = addRecordRaw(loc, loc_end, cfa, fp_off);
+        // The next row is only needed to know where the target's row ends
+        _past_target = _fixed && loc > _target_loc;
     }
 }
 
 FrameDesc* DwarfParser::addRecordRaw(u32 loc, u32 loc_end, int cfa, int fp_off) {
     if (_count >= _capacity) {
-        _capacity *= 2;
-        _table = (FrameDesc*)realloc(_table, _capacity * sizeof(FrameDesc));
+        if (_fixed) {
+            // Every row so far is at or before the target, so only the
+            // last one can still apply to it
+            _table[0] = _table[_count - 1];
+            _count = 1;
+        } else {
+            _capacity *= 2;
+            _table = (FrameDesc*)realloc(_table, _capacity * sizeof(FrameDesc));
+        }
     }
 
     FrameDesc* f = &_table[_count++];
@@ -18,6 +18,7 @@
 #define _DWARF_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "arch.h"
 
 
@@ -82,6 +83,19 @@ class DwarfParser {
     FrameDesc* _table;
     FrameDesc* _prev;
 
+    // Set when decoding a single FDE into a fixed buffer, in which case only
+    // the rows around _target_loc are kept
+    bool _fixed;
+    bool _past_target;
+    u32 _target_loc;
+
+    // Set when the sections may be unmapped while they are read, in which
+    // case reads go through SafeAccess a word at a time, and the last word
+    // is kept for the following bytes
+    bool _checked;
+    const char* _word_addr;
+    uintptr_t _word;
+
     u32 _code_align;
     int _data_align;
 
@@ -91,22 +105,40 @@ class DwarfParser {
         return ptr;
     }
 
+    u8 checkedByte(const char* ptr);
+
+    u8 byteAt(const char* ptr) {
+        if (!_checked) {
+            return *(const u8*)ptr;
+        }
+        uintptr_t offset = (uintptr_t)ptr - (uintptr_t)_word_addr;
+        return offset < sizeof(_word) ? ((const u8*)&_word)[offset] : checkedByte(ptr);
+    }
+
     u8 get8() {
-        return *_ptr++;
+        return byteAt(_ptr++);
     }
 
     u16 get16() {
+        if (_checked) {
+            u16 lo = get8();
+            return lo | get8() << 8;
+        }
         return *(u16*)add(2);
     }
 
     u32 get32() {
+        if (_checked) {
+            u32 lo = get16();
+            return lo | (u32)get16() << 16;
+        }
         return *(u32*)add(4);
     }
 
     u32 getLeb() {
         u32 result = 0;
         for (u32 shift = 0; ; shift += 7) {
-            u8 b = *_ptr++;
+            u8 b = get8();
             result |= (b & 0x7f) << shift;
             if ((b & 0x80) == 0) {
                 return result;
@@ -117,7 +149,7 @@ class DwarfParser {
     int getSLeb() {
         int result = 0;
         for (u32 shift = 0; ; shift += 7) {
-            u8 b = *_ptr++;
+            u8 b = get8();
             result |= (b & 0x7f) << shift;
             if ((b & 0x80) == 0) {
                 if ((b & 0x40) != 0 && (shift += 7) < 32) {
@@ -129,12 +161,12 @@ class DwarfParser {
     }
 
     void skipLeb() {
-        while (*_ptr++ & 0x80) {}
+        while (get8() & 0x80) {}
     }
 
     const char* getPtr() {
         const char* ptr = _ptr;
-        return ptr + *(int*)add(4);
+        return ptr + (int)get32();
     }
 
     void parse(const char* eh_frame_hdr);
@@ -149,6 +181,18 @@ class DwarfParser {
   public:
     DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr);
 
+    // Decodes only the given FDE into the buffer, without allocating, so that
+    // it can be used from a signal handler. Rows are kept up to and including
+    // the first one after target_loc. If they don't fit, earlier rows are
+    // dropped, keeping the one which applies to target_loc. Reads are done
+    // through SafeAccess, and read zeros where they fault.
+    DwarfParser(const char* image_base, const char* fde, u32 target_loc, FrameDesc* buffer, int capacity);
+
+    // Returns the FDE which may cover target_loc according to the binary
+    // search table in .eh_frame_hdr, or NULL. Does not allocate, and reads
+    // through SafeAccess like the constructor above.
+    static const char* findFde(const char* image_base, const char* eh_frame_hdr, u32 target_loc);
+
     FrameDesc* table() const {
         return _table;
     }
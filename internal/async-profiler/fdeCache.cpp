@@ -0,0 +1,162 @@
+#include <string.h>
+
+#include "fdeCache.h"
+#include "safeAccess.h"
+
+// Rows beyond this many in a single FDE are only cached around the location
+// which was looked up
+const int FDE_CACHE_ROWS = 8;
+const int FDE_CACHE_SLOTS = 512;
+// Enough rows that a typical FDE is decoded without dropping any
+const int FDE_DECODE_ROWS = 64;
+
+// A decoded FDE. Slots are written under a sequence lock: a writer makes seq
+// odd while it updates the slot, and readers discard what they copied if seq
+// changed in the meantime.
+struct FdeSlot {
+    u32 seq;
+    int count;
+    uint64_t library;
+    const char* fde;
+    // Locations [lo, hi) the cached rows cover
+    u32 lo;
+    u32 hi;
+    FrameDesc rows[FDE_CACHE_ROWS];
+};
+
+static FdeSlot slots[FDE_CACHE_SLOTS];
+static FdeCache::Stats stats;
+
+static FdeSlot* slotFor(const char* fde) {
+    uintptr_t h = ((uintptr_t)fde >> 2) * 0x9e3779b97f4a7c15ULL;
+    return &slots[(h >> 32) % FDE_CACHE_SLOTS];
+}
+
+// Finds the row for target_loc among rows sorted by location, which apply
+// until the next row or through their loc_end, and until hi at the latest
+static bool findRow(const FrameDesc* rows, int count, u32 hi, u32 target_loc,
+                    FrameDesc& frame, u32* start, u32* end) {
+    int i = count - 1;
+    while (i >= 0 && rows[i].loc > target_loc) {
+        i--;
+    }
+    if (i < 0 || target_loc > rows[i].loc_end) {
+        return false;
+    }
+
+    u64 range_end = (u64)rows[i].loc_end + 1;
+    if (i + 1 < count && rows[i + 1].loc < range_end) {
+        range_end = rows[i + 1].loc;
+    }
+    if (hi < range_end) {
+        range_end = hi;
+    }
+    frame = rows[i];
+    *start = rows[i].loc;
+    *end = range_end;
+    return true;
+}
+
+static bool lookup(uint64_t library, const char* fde, u32 target_loc, FrameDesc& frame, u32* start, u32* end) {
+    FdeSlot* slot = slotFor(fde);
+    u32 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return false;
+    }
+
+    FdeSlot copy;
+    memcpy(&copy, slot, sizeof(FdeSlot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+        return false;
+    }
+
+    if (copy.fde != fde || copy.library != library || target_loc < copy.lo || target_loc >= copy.hi) {
+        return false;
+    }
+    return findRow(copy.rows, copy.count, copy.hi, target_loc, frame, start, end);
+}
+
+static void insert(uint64_t library, const char* fde, const FrameDesc* rows, int count, u32 target_loc) {
+    // Decoding stops at the first row after the target, which is only there
+    // to say where the target's row ends
+    u64 limit = (u64)rows[count - 1].loc_end + 1;
+    if (rows[count - 1].loc > target_loc) {
+        limit = rows[--count].loc;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    // Keep the rows nearest the target if they don't all fit
+    int first = 0;
+    if (count > FDE_CACHE_ROWS) {
+        int target = count - 1;
+        while (target > 0 && rows[target].loc > target_loc) {
+            target--;
+        }
+        first = target - FDE_CACHE_ROWS / 2;
+        if (first < 0) first = 0;
+        if (first > count - FDE_CACHE_ROWS) first = count - FDE_CACHE_ROWS;
+    }
+    int n = count - first < FDE_CACHE_ROWS ? count - first : FDE_CACHE_ROWS;
+    u32 lo = rows[first].loc;
+    u64 hi = first + n < count ? rows[first + n].loc : limit;
+    if (hi > 0xffffffff) {
+        hi = 0xffffffff;
+    }
+
+    FdeSlot* slot = slotFor(fde);
+    u32 seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    // Skip caching if another thread is writing the slot
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->library = library;
+    slot->fde = fde;
+    slot->count = n;
+    slot->lo = lo;
+    slot->hi = hi;
+    memcpy(slot->rows, rows + first, n * sizeof(FrameDesc));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+namespace FdeCache {
+
+bool findFrameDesc(uint64_t library, const char* image_base, const char* eh_frame_hdr, u32 target_loc,
+                   FrameDesc& frame, u32* start, u32* end) {
+    // A faulted read returns zeros, which the parser stops at, but whatever
+    // it got up to then can't be trusted. Faults on other threads are counted
+    // too, which only costs a lookup.
+    uint64_t faults = SafeAccess::faults();
+    const char* fde = DwarfParser::findFde(image_base, eh_frame_hdr, target_loc);
+    if (fde == NULL || SafeAccess::faults() != faults) {
+        return false;
+    }
+
+    if (lookup(library, fde, target_loc, frame, start, end)) {
+        __atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    __atomic_fetch_add(&stats.misses, 1, __ATOMIC_RELAXED);
+
+    FrameDesc rows[FDE_DECODE_ROWS];
+    DwarfParser dwarf(image_base, fde, target_loc, rows, FDE_DECODE_ROWS);
+    if (dwarf.count() == 0 || SafeAccess::faults() != faults) {
+        return false;
+    }
+    insert(library, fde, rows, dwarf.count(), target_loc);
+    return findRow(rows, dwarf.count(), 0xffffffff, target_loc, frame, start, end);
+}
+
+void getStats(Stats& s) {
+    s.hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    s.misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+}
+
+size_t size() {
+    return sizeof(slots);
+}
+
+}
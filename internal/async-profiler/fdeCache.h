@@ -0,0 +1,37 @@
+#ifndef _FDECACHE_H
+#define _FDECACHE_H
+
+#include <stdint.h>
+#include "arch.h"
+#include "dwarf.h"
+
+// FdeCache finds frame descriptions by decoding FDEs straight from a library's
+// .eh_frame_hdr and .eh_frame sections, without building an unwind table.
+// Recently decoded FDEs are kept in a small, fixed-size cache shared by all
+// threads, so memory use is bounded by the number of hot functions rather
+// than the size of the libraries. Lookups never allocate or block, so they
+// can be done from a signal handler.
+namespace FdeCache {
+
+struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Returns the frame description for target_loc, relative to image_base, and
+// a range [start, end) of locations it also applies to. library is the
+// CodeCache's load id, which cached FDEs are tagged with, so that a library
+// loaded at the address of an unloaded one never gets its rows. The sections
+// are read through SafeAccess, and nothing is returned if a read faulted
+// because the library was unloaded meanwhile.
+bool findFrameDesc(uint64_t library, const char* image_base, const char* eh_frame_hdr, u32 target_loc,
+                   FrameDesc& frame, u32* start, u32* end);
+
+void getStats(Stats& stats);
+
+// Size of the cache in bytes
+size_t size();
+
+}
+
+#endif // _FDECACHE_H
@@ -0,0 +1,32 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+package asyncprofiler
+
+import (
+	"fmt"
+	"testing"
+)
+
+func TestNameIndexMatchesScan(t *testing.T) {
+	const count = 5000
+	indexed := newBenchSymbols(count, true)
+	defer indexed.close()
+	scanned := newBenchSymbols(count, false)
+	defer scanned.close()
+
+	var names []string
+	for pkg := 0; pkg < 1000; pkg += 7 {
+		names = append(names, fmt.Sprintf("pkg%d", pkg), fmt.Sprintf("pkg%d.", pkg))
+		names = append(names, fmt.Sprintf("pkg%d.func%d", pkg, pkg*3))
+	}
+	names = append(names, "", "nothing")
+	for _, name := range names {
+		for _, prefix := range []bool{false, true} {
+			got, want := indexed.lookup(name, prefix), scanned.lookup(name, prefix)
+			if got != want {
+				t.Errorf("lookup(%q, prefix=%v) = %#x with the index, %#x without", name, prefix, got, want)
+			}
+		}
+	}
+}
@@ -0,0 +1,243 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "persistentCache.h"
+#include "symbols.h"
+#include "unwindTable.h"
+
+// Identifies the file format, including the size of a pointer. Change the
+// version whenever the layout of the file or of UnwindTable changes.
+static const char CACHE_MAGIC[8] = {'C', 'G', 'O', 'T', 'B', 'C', '0' + sizeof(void*), '2'};
+
+// The file layout is:
+//
+//     CacheHeader
+//     CachedSymbol symbols[symbol_count]
+//     char         names[names_size]
+//     UnwindTable  table, at table_offset, if table_size is non-zero
+struct CacheHeader {
+    char magic[8];
+    uint32_t flags;
+    uint32_t reserved;
+    uint32_t symbol_count;
+    uint32_t names_size;
+    uint64_t table_offset;
+    uint64_t table_size;
+};
+
+// A symbol, with its address relative to the image base
+struct CachedSymbol {
+    int64_t offset;
+    uint32_t length;
+    uint32_t name;
+};
+
+// Set if the file has every symbol rather than none
+static const uint32_t FLAG_ALL_SYMBOLS = 1;
+
+static const size_t TABLE_ALIGNMENT = 8;
+
+static pthread_once_t directory_once = PTHREAD_ONCE_INIT;
+static const char* directory = NULL;
+
+static void initDirectory() {
+    const char* dir = getenv("CGOTRACEBACK_CACHE_DIR");
+    if (dir != NULL && dir[0] != 0) {
+        directory = strdup(dir);
+    }
+}
+
+static const char* cacheDirectory() {
+    pthread_once(&directory_once, initDirectory);
+    return directory;
+}
+
+static bool cachePath(char* path, const char* build_id, int build_id_len, const char* suffix) {
+    const char* dir = cacheDirectory();
+    if (dir == NULL || build_id_len <= 0 || build_id_len > 64) {
+        return false;
+    }
+    char* p = path + snprintf(path, PATH_MAX - 2 * build_id_len - 32, "%s/", dir);
+    for (int i = 0; i < build_id_len; i++) {
+        p += sprintf(p, "%02hhx", build_id[i]);
+    }
+    sprintf(p, "%s", suffix);
+    return true;
+}
+
+static bool writeAll(int fd, const char* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+namespace PersistentCache {
+
+void setDirectory(const char* dir) {
+    pthread_once(&directory_once, initDirectory);
+    free((void*)directory);
+    directory = dir != NULL && dir[0] != 0 ? strdup(dir) : NULL;
+}
+
+bool enabled() {
+    return cacheDirectory() != NULL;
+}
+
+int load(CodeCache* cc, const char* image_base, const char* build_id, int build_id_len) {
+    char path[PATH_MAX];
+    if (!cachePath(path, build_id, build_id_len, ".cache")) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t length = st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+
+    const char* base = (const char*)addr;
+    const CacheHeader* header = (const CacheHeader*)base;
+    size_t names_offset = sizeof(CacheHeader) + (size_t)header->symbol_count * sizeof(CachedSymbol);
+    size_t names_end = names_offset + header->names_size;
+    bool valid = memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+        && names_end <= length
+        && (header->names_size == 0 || base[names_end - 1] == 0);
+    if (valid && header->table_size != 0) {
+        valid = header->table_offset >= names_end
+            && header->table_offset <= length
+            && header->table_offset % TABLE_ALIGNMENT == 0
+            && header->table_size >= sizeof(UnwindTable)
+            && header->table_offset + header->table_size == length
+            // The table is read by signal handlers, so a corrupt or foreign
+            // file must not send lookups outside it
+            && ((const UnwindTable*)(base + header->table_offset))->valid(header->table_size);
+    }
+    if (!valid) {
+        munmap(addr, length);
+        return 0;
+    }
+
+    // A file written with SYMBOLS_NONE doesn't have the symbols for
+    // SYMBOLS_ALL, but SYMBOLS_NONE needs none
+    int cached = 0;
+    bool keep_mapping = false;
+    if (Symbols::symbolMode() == SYMBOLS_NONE) {
+        cached |= CACHED_SYMBOLS;
+    } else if (header->flags & FLAG_ALL_SYMBOLS) {
+        const CachedSymbol* symbols = (const CachedSymbol*)(header + 1);
+        const char* names = base + names_offset;
+        for (uint32_t i = 0; i < header->symbol_count; i++) {
+            if (symbols[i].name < header->names_size) {
+                cc->addMapped(image_base + symbols[i].offset, symbols[i].length, names + symbols[i].name);
+                keep_mapping = true;
+            }
+        }
+        cached |= CACHED_SYMBOLS;
+    }
+
+    if (header->table_size != 0) {
+        // The table is used in place. Tables are only stored for libraries
+        // whose text base is the image base, see store.
+        cc->setTextBase(image_base);
+        cc->setMappedUnwindTable((const UnwindTable*)(base + header->table_offset));
+        keep_mapping = true;
+        cached |= CACHED_UNWIND_TABLE;
+    }
+
+    if (keep_mapping) {
+        cc->addMapping(addr, length);
+    } else {
+        munmap(addr, length);
+    }
+    return cached;
+}
+
+bool store(CodeCache* cc, const char* image_base, const char* build_id, int build_id_len) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (!cachePath(path, build_id, build_id_len, ".cache")) {
+        return false;
+    }
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%p.tmp", (int)getpid(), (void*)cc);
+    cachePath(tmp_path, build_id, build_id_len, suffix);
+
+    int symbol_count = cc->count();
+    const CodeBlob* blobs = cc->blobs();
+    size_t names_size = 0;
+    for (int i = 0; i < symbol_count; i++) {
+        names_size += strlen(blobs[i]._name) + 1;
+    }
+
+    const UnwindTable* table = cc->getTextBase() == image_base ? cc->unwindTable() : NULL;
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.flags = Symbols::symbolMode() == SYMBOLS_ALL ? FLAG_ALL_SYMBOLS : 0;
+    header.reserved = 0;
+    header.symbol_count = symbol_count;
+    header.names_size = names_size;
+    header.table_size = table != NULL ? table->size() : 0;
+    size_t names_end = sizeof(CacheHeader) + symbol_count * sizeof(CachedSymbol) + names_size;
+    header.table_offset = header.table_size != 0 ? (names_end + TABLE_ALIGNMENT - 1) & ~(TABLE_ALIGNMENT - 1) : 0;
+
+    size_t length = header.table_size != 0 ? header.table_offset + header.table_size : names_end;
+    char* buf = (char*)calloc(1, length);
+    if (buf == NULL) {
+        return false;
+    }
+    memcpy(buf, &header, sizeof(header));
+    CachedSymbol* symbols = (CachedSymbol*)(buf + sizeof(header));
+    char* names = (char*)(symbols + symbol_count);
+    uint32_t name = 0;
+    for (int i = 0; i < symbol_count; i++) {
+        symbols[i].offset = (const char*)blobs[i]._start - image_base;
+        symbols[i].length = (const char*)blobs[i]._end - (const char*)blobs[i]._start;
+        symbols[i].name = name;
+        size_t len = strlen(blobs[i]._name) + 1;
+        memcpy(names + name, blobs[i]._name, len);
+        name += len;
+    }
+    if (table != NULL) {
+        memcpy(buf + header.table_offset, table, header.table_size);
+    }
+
+    // Write to a temporary file and rename it, so that other processes never
+    // map a partially written file
+    bool ok = false;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd != -1) {
+        ok = writeAll(fd, buf, length);
+        close(fd);
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok) {
+            unlink(tmp_path);
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+}
@@ -0,0 +1,40 @@
+#ifndef _PERSISTENTCACHE_H
+#define _PERSISTENTCACHE_H
+
+#include "codeCache.h"
+
+// PersistentCache saves the symbols and unwind table parsed from a library to
+// a file named after the library's build ID, so that other processes loading
+// the same library can map the file instead of parsing the library again.
+// Unwind tables and symbol names are used in place from the mapping, so
+// processes on the same host share their pages through the page cache.
+//
+// The cache is disabled unless a directory is configured, either through the
+// CGOTRACEBACK_CACHE_DIR environment variable or with setDirectory. A tmpfs
+// is a good choice. Files are written atomically, and ones which don't match
+// the expected format are ignored.
+namespace PersistentCache {
+
+// What a cache file provided for a library
+enum {
+    CACHED_SYMBOLS = 1,
+    CACHED_UNWIND_TABLE = 2
+};
+
+// Overrides CGOTRACEBACK_CACHE_DIR. NULL disables the cache.
+void setDirectory(const char* dir);
+
+bool enabled();
+
+// Loads the symbols and unwind table of the library with the given build ID
+// and image base into cc. Returns a combination of the CACHED_ flags for the
+// parts found in the cache.
+int load(CodeCache* cc, const char* image_base, const char* build_id, int build_id_len);
+
+// Saves the symbols and unwind table of cc, replacing any previous file for
+// the same build ID. Returns whether the file was written.
+bool store(CodeCache* cc, const char* image_base, const char* build_id, int build_id_len);
+
+}
+
+#endif // _PERSISTENTCACHE_H
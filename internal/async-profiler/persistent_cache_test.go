@@ -0,0 +1,83 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+package asyncprofiler
+
+import (
+	"bytes"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func TestPersistentCacheMatchesParse(t *testing.T) {
+	want := benchParseLibraries(dwarfEager, symbolsAll, 1)
+
+	dir := t.TempDir()
+	setCacheDir(dir)
+	defer setCacheDir("")
+
+	// The first parse populates the cache, and the second loads from it
+	for _, pass := range []string{"cold", "warm"} {
+		got := benchParseLibraries(dwarfEager, symbolsAll, 1)
+		if got.tableBytes != want.tableBytes || got.symbols != want.symbols {
+			t.Errorf("%s cache: got %d table bytes and %d symbols, want %d and %d",
+				pass, got.tableBytes, got.symbols, want.tableBytes, want.symbols)
+		}
+	}
+
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(entries) == 0 {
+		t.Error("no cache files were written")
+	}
+}
+
+func TestPersistentCacheRejectsCorruptFiles(t *testing.T) {
+	dir := t.TempDir()
+	setCacheDir(dir)
+	defer setCacheDir("")
+	benchParseLibraries(dwarfEager, symbolsAll, 1)
+
+	// The last word of a file is the last record of its unwind table, or
+	// the end of its symbol names, so making it all ones leaves a record
+	// with a kind out of range, or names without a terminator
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	original := make(map[string][]byte)
+	for _, e := range entries {
+		path := filepath.Join(dir, e.Name())
+		data, err := os.ReadFile(path)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(data) < 4 {
+			continue
+		}
+		original[path] = data
+		corrupt := append([]byte(nil), data...)
+		copy(corrupt[len(corrupt)-4:], []byte{0xff, 0xff, 0xff, 0xff})
+		if err := os.WriteFile(path, corrupt, 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	if len(original) == 0 {
+		t.Skip("no cache files were written")
+	}
+
+	// Rejected files are parsed again and replaced
+	benchParseLibraries(dwarfEager, symbolsAll, 1)
+	for path, want := range original {
+		got, err := os.ReadFile(path)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if !bytes.Equal(got, want) {
+			t.Errorf("corrupt cache file %s was used", filepath.Base(path))
+		}
+	}
+}
@@ -8,6 +8,7 @@
 #include "stackFrame.h"
 
 static struct sigaction oldact;
+static uint64_t fault_count = 0;
 
 namespace SafeAccess {
 
@@ -15,6 +16,10 @@ NOINLINE __attribute__((aligned(16))) void* load(void** ptr) {
     return *ptr;
 }
 
+uint64_t faults() {
+    return __atomic_load_n(&fault_count, __ATOMIC_RELAXED);
+}
+
 // skipFaultInstruction returns the address of the instruction immediately
 // following the given instruction. pc is assumed to point to the same kind of
 // load that SafeAccess::load would use
@@ -48,6 +53,7 @@ static void segv_handler(int sig, siginfo_t *si, void *ucontext) {
         uintptr_t instructionEncodedLength = SafeAccess::skipFaultInstruction(frame.pc());
         frame.pc() += instructionEncodedLength;
         frame.retval() = 0x0;
+        __atomic_fetch_add(&fault_count, 1, __ATOMIC_RELAXED);
         return;
     }
 
@@ -30,6 +30,9 @@ namespace SafeAccess {
 
 NOINLINE __attribute__((aligned(16))) void* load(void** ptr);
 
+// The number of faults recovered from in load
+uint64_t faults();
+
 }
 
 #endif // _SAFEACCESS_H
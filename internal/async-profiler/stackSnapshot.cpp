@@ -0,0 +1,267 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "arch.h"
+#include "stackSnapshot.h"
+
+extern "C" int async_cgo_traceback_max_depth(void);
+
+enum SnapshotState {
+    SNAPSHOT_FREE,
+    SNAPSHOT_CAPTURING,
+    SNAPSHOT_CAPTURED,
+    SNAPSHOT_UNWOUND,
+    SNAPSHOT_READING
+};
+
+// Headers take a cache line each, so that snapshots don't share them
+const size_t SNAPSHOT_HEADER_BYTES = 64;
+const size_t RING_HEADER_BYTES = 64;
+
+// The copied stack, and then the unwound call stack, follows the header
+struct Snapshot {
+    int state;
+    int depth;
+    size_t length;
+    StackContext sc;
+    SnapshotSample sample;
+
+    char* data() {
+        return (char*)this + SNAPSHOT_HEADER_BYTES;
+    }
+};
+
+static_assert(sizeof(Snapshot) <= SNAPSHOT_HEADER_BYTES, "snapshot header too big");
+
+const int MIN_SNAPSHOT_WINDOW = 256;
+
+// The calling thread's id, or 0 until its first snapshot, since gettid is a
+// system call. A forked child's thread has a new id, so the fork handler
+// clears it.
+static __thread int snapshot_tid __attribute__((tls_model("initial-exec"))) = 0;
+
+static int currentTid() {
+#ifdef __linux__
+    if (snapshot_tid == 0) {
+        snapshot_tid = (int)syscall(SYS_gettid);
+    }
+#endif
+    return snapshot_tid;
+}
+
+static void clearTid() {
+    snapshot_tid = 0;
+}
+
+SnapshotBuffer::SnapshotBuffer() : _memory(NULL), _memory_bytes(0), _snapshot_bytes(0), _cpus(0), _window(0) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+SnapshotBuffer::~SnapshotBuffer() {
+    if (_memory != NULL) {
+        munmap(_memory, _memory_bytes);
+    }
+}
+
+bool SnapshotBuffer::init(int window) {
+    if (window <= 0) {
+        window = DEFAULT_SNAPSHOT_WINDOW;
+    } else if (window < MIN_SNAPSHOT_WINDOW) {
+        window = MIN_SNAPSHOT_WINDOW;
+    } else if (window > MAX_SNAPSHOT_WINDOW) {
+        window = MAX_SNAPSHOT_WINDOW;
+    }
+    window = (window + 63) & ~63;
+
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    _snapshot_bytes = SNAPSHOT_HEADER_BYTES + window;
+    _memory_bytes = cpus * (RING_HEADER_BYTES + SNAPSHOTS_PER_CPU * _snapshot_bytes);
+    void* p = mmap(NULL, _memory_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    _memory = (char*)p;
+    _cpus = (int)cpus;
+    _window = window;
+    return true;
+}
+
+Snapshot* SnapshotBuffer::get(int cpu, int i) {
+    char* ring = _memory + cpu * (RING_HEADER_BYTES + SNAPSHOTS_PER_CPU * _snapshot_bytes);
+    return (Snapshot*)(ring + RING_HEADER_BYTES + i * _snapshot_bytes);
+}
+
+bool SnapshotBuffer::capture(const StackContext &sc) {
+    int cpu = 0;
+#ifdef __linux__
+    cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+#endif
+    // CPUs may have been added since init
+    cpu %= _cpus;
+
+    // Each ring's header holds where its next capture starts looking for a
+    // free snapshot
+    unsigned* next = (unsigned*)(_memory + cpu * (RING_HEADER_BYTES + SNAPSHOTS_PER_CPU * _snapshot_bytes));
+    unsigned start = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < SNAPSHOTS_PER_CPU; i++) {
+        Snapshot* s = get(cpu, (start + i) % SNAPSHOTS_PER_CPU);
+        int expected = SNAPSHOT_FREE;
+        if (!__atomic_compare_exchange_n(&s->state, &expected, SNAPSHOT_CAPTURING, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        s->sc = sc;
+        s->sample.tid = currentTid();
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        s->sample.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        // The interrupted function may have left something it still needs,
+        // such as its caller's frame pointer after a leave, in the red zone
+        s->length = copyStack(sc.sp - RED_ZONE_SIZE, s->data(), _window);
+        __atomic_store_n(&s->state, SNAPSHOT_CAPTURED, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&_stats.captured, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_stats.bytes, s->length, __ATOMIC_RELAXED);
+        return true;
+    }
+    __atomic_fetch_add(&_stats.dropped, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+int SnapshotBuffer::unwindPending(CodeCacheArray* cache, int max_depth) {
+    // The call stack replaces the copied stack, so it can't be any bigger
+    int capacity = _window / sizeof(uintptr_t);
+    if (max_depth > capacity) {
+        max_depth = capacity;
+    }
+    if (max_depth > MAX_SNAPSHOT_DEPTH) {
+        max_depth = MAX_SNAPSHOT_DEPTH;
+    }
+    uintptr_t callchain[MAX_SNAPSHOT_DEPTH];
+
+    int unwound = 0;
+    for (int cpu = 0; cpu < _cpus; cpu++) {
+        for (int i = 0; i < SNAPSHOTS_PER_CPU; i++) {
+            Snapshot* s = get(cpu, i);
+            if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SNAPSHOT_CAPTURED) {
+                continue;
+            }
+            StackContext sc = s->sc;
+            int depth = stackWalkCopy(cache, sc, s->data(), sc.sp - RED_ZONE_SIZE, s->length, callchain, max_depth);
+            memcpy(s->data(), callchain, depth * sizeof(uintptr_t));
+            s->depth = depth;
+            __atomic_store_n(&s->state, SNAPSHOT_UNWOUND, __ATOMIC_RELEASE);
+            unwound++;
+        }
+    }
+    __atomic_fetch_add(&_stats.unwound, unwound, __ATOMIC_RELAXED);
+    return unwound;
+}
+
+int SnapshotBuffer::read(uintptr_t* callchain, int max_depth, SnapshotSample* sample) {
+    for (int cpu = 0; cpu < _cpus; cpu++) {
+        for (int i = 0; i < SNAPSHOTS_PER_CPU; i++) {
+            Snapshot* s = get(cpu, i);
+            int expected = SNAPSHOT_UNWOUND;
+            if (!__atomic_compare_exchange_n(&s->state, &expected, SNAPSHOT_READING, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            int depth = s->depth < max_depth ? s->depth : max_depth;
+            memcpy(callchain, s->data(), depth * sizeof(uintptr_t));
+            if (sample != NULL) {
+                *sample = s->sample;
+            }
+            __atomic_store_n(&s->state, SNAPSHOT_FREE, __ATOMIC_RELEASE);
+            return depth;
+        }
+    }
+    return -1;
+}
+
+void SnapshotBuffer::stats(StackSnapshotStats &stats) {
+    stats.captured = __atomic_load_n(&_stats.captured, __ATOMIC_RELAXED);
+    stats.dropped = __atomic_load_n(&_stats.dropped, __ATOMIC_RELAXED);
+    stats.unwound = __atomic_load_n(&_stats.unwound, __ATOMIC_RELAXED);
+    stats.bytes = __atomic_load_n(&_stats.bytes, __ATOMIC_RELAXED);
+}
+
+namespace StackSnapshots {
+
+// Allocated by the first enable, and never freed, since a signal handler or
+// the UnwindWorker may be using it
+static SnapshotBuffer* buffer = NULL;
+static int enabled = 0;
+static pthread_mutex_t enable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool enable(int window) {
+#ifdef __linux__
+    pthread_mutex_lock(&enable_lock);
+    if (buffer == NULL) {
+        pthread_atfork(NULL, NULL, clearTid);
+        SnapshotBuffer* b = new SnapshotBuffer();
+        if (!b->init(window)) {
+            delete b;
+            pthread_mutex_unlock(&enable_lock);
+            return false;
+        }
+        __atomic_store_n(&buffer, b, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&enable_lock);
+    return true;
+#else
+    // There's no UnwindWorker to unwind the snapshots
+    return false;
+#endif
+}
+
+void disable() {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+}
+
+SnapshotBuffer* active() {
+    if (__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+    return __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+}
+
+void unwindPending(CodeCacheArray* cache) {
+    SnapshotBuffer* b = __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+    if (b != NULL) {
+        b->unwindPending(cache, async_cgo_traceback_max_depth());
+    }
+}
+
+int read(uintptr_t* callchain, int max_depth, SnapshotSample* sample) {
+    SnapshotBuffer* b = __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+    if (b == NULL) {
+        return -1;
+    }
+    return b->read(callchain, max_depth, sample);
+}
+
+void stats(StackSnapshotStats &stats) {
+    SnapshotBuffer* b = __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+    if (b == NULL) {
+        memset(&stats, 0, sizeof(stats));
+        return;
+    }
+    b->stats(stats);
+}
+
+}
@@ -0,0 +1,118 @@
+#ifndef _STACKSNAPSHOT_H
+#define _STACKSNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codeCache.h"
+#include "stackWalker.h"
+
+// The default and largest number of bytes of stack copied by a snapshot
+#define DEFAULT_SNAPSHOT_WINDOW 8192
+#define MAX_SNAPSHOT_WINDOW 65536
+
+// The number of snapshots each CPU can hold until they're unwound and read
+#define SNAPSHOTS_PER_CPU 16
+
+// The most frames unwound from a snapshot
+#define MAX_SNAPSHOT_DEPTH 1024
+
+struct StackSnapshotStats {
+    uint64_t captured;
+    // Samples lost because every snapshot of their CPU was in use
+    uint64_t dropped;
+    uint64_t unwound;
+    // Bytes of stack copied by captured snapshots
+    uint64_t bytes;
+};
+
+// Identifies the profiling signal a snapshot was taken for
+struct SnapshotSample {
+    // The thread which was interrupted
+    int tid;
+    // When the snapshot was taken, in CLOCK_MONOTONIC nanoseconds
+    uint64_t time;
+};
+
+struct Snapshot;
+
+// SnapshotBuffer holds snapshots of the registers and the top of the stack of
+// sampled threads, taken in a signal handler and unwound later on another
+// thread, like perf's DWARF call graphs.
+//
+// Each CPU has a ring of snapshots, so handlers on different CPUs don't
+// write to the same memory. A snapshot goes from free, to being captured, to
+// captured, to unwound, which replaces the copied stack with its call stack,
+// and back to free once it's read. Each step is taken with a
+// compare-and-swap or a release store of its state, without any lock. A
+// handler may be moved to another CPU while it captures, so a ring may have
+// several writers, which each claim a snapshot with a compare-and-swap.
+class SnapshotBuffer {
+  private:
+    char* _memory;
+    size_t _memory_bytes;
+    size_t _snapshot_bytes;
+    int _cpus;
+    int _window;
+    StackSnapshotStats _stats;
+
+    Snapshot* get(int cpu, int i);
+
+  public:
+    SnapshotBuffer();
+    ~SnapshotBuffer();
+
+    // Allocates snapshots of window bytes of stack for every CPU. Not signal
+    // safe.
+    bool init(int window);
+
+    int window() const {
+        return _window;
+    }
+
+    // Takes a snapshot of the calling thread's stack at sc. Returns false if
+    // the current CPU has no free snapshot. Signal safe.
+    bool capture(const StackContext &sc);
+
+    // Unwinds every captured snapshot, up to max_depth frames each, and
+    // returns how many were unwound. The calling thread must not walk its
+    // own stack meanwhile, as for stackWalkCopy.
+    int unwindPending(CodeCacheArray* cache, int max_depth);
+
+    // Copies the call stack of an unwound snapshot, up to max_depth frames,
+    // to callchain, and which sample it was taken for to sample, if it isn't
+    // NULL, and frees the snapshot. Returns the number of frames, or -1 if no
+    // snapshot has been unwound. Snapshots aren't necessarily read in the
+    // order they were captured.
+    int read(uintptr_t* callchain, int max_depth, SnapshotSample* sample = NULL);
+
+    void stats(StackSnapshotStats &stats);
+};
+
+// The process-wide snapshot buffer used for profiling signals, which the
+// UnwindWorker unwinds
+namespace StackSnapshots {
+
+// Starts taking snapshots instead of unwinding in the signal handler. The
+// buffer is allocated by the first call, with the given window, and later
+// calls keep it. Returns false if snapshots aren't supported on this
+// platform or the buffer couldn't be allocated.
+bool enable(int window);
+
+void disable();
+
+// Returns the buffer if snapshots are enabled, or NULL. Signal safe.
+SnapshotBuffer* active();
+
+// Unwinds the captured snapshots, even if snapshots have since been
+// disabled. Called by the UnwindWorker.
+void unwindPending(CodeCacheArray* cache);
+
+// Reads an unwound snapshot, as for SnapshotBuffer::read
+int read(uintptr_t* callchain, int max_depth, SnapshotSample* sample);
+
+void stats(StackSnapshotStats &stats);
+
+}
+
+#endif // _STACKSNAPSHOT_H
@@ -16,32 +16,248 @@
  *
  * Modified by Nick Ripley to extract components needed for call stack unwinding
  */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include "codeCache.h"
 #include "stackWalker.h"
 #include "dwarf.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
+#include "unwindWorker.h"
+
+// The bounds of the thread's stack, once cacheThreadStackBounds has been
+// called on it. Reads from the walked stack within the bounds are plain
+// loads, and only reads outside them go through SafeAccess::load, which
+// relies on recovering from a fault. Initial-exec, like the cgo_context pool,
+// since the general dynamic model isn't signal safe in a dlopened library.
+struct ThreadStack {
+    uintptr_t low;
+    uintptr_t high;
+    bool checked;
+    // Fallback reads since the last flush to the global StackReadStats. A
+    // signal handler may interrupt an increment, so a few may be lost.
+    uint64_t fallback;
+    // Set during stackWalkCopy to the copy being walked, which holds what
+    // was at [copy_low, copy_high). The thread's own bounds are cleared
+    // meanwhile, so every read takes the fallback path and is redirected.
+    const char* copy;
+    uintptr_t copy_low;
+    uintptr_t copy_high;
+};
+
+const int STACK_READ_FLUSH = 256;
+
+static __thread ThreadStack thread_stack __attribute__((tls_model("initial-exec")));
+static StackReadStats stack_read_stats;
+
+void cacheThreadStackBounds() {
+    ThreadStack &ts = thread_stack;
+    if (ts.checked) {
+        return;
+    }
+    ts.checked = true;
+
+    void* addr = NULL;
+    size_t size = 0;
+#ifdef __APPLE__
+    pthread_t self = pthread_self();
+    size = pthread_get_stacksize_np(self);
+    addr = (char*)pthread_get_stackaddr_np(self) - size;
+#else
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return;
+    }
+    if (pthread_attr_getstack(&attr, &addr, &size) != 0) {
+        size = 0;
+    }
+    pthread_attr_destroy(&attr);
+#endif
+    if (size == 0) {
+        return;
+    }
+
+    // A signal handler on this thread may read the bounds in between, so
+    // publish the upper bound last. Until then the range is empty.
+    ts.low = (uintptr_t)addr;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    ts.high = (uintptr_t)addr + size;
+}
+
+bool threadStackBoundsCached() {
+    return thread_stack.high != 0;
+}
+
+void getStackReadStats(StackReadStats &stats) {
+    stats.fallback = __atomic_load_n(&stack_read_stats.fallback, __ATOMIC_RELAXED);
+    stats.faults = SafeAccess::faults();
+}
+
+static NOINLINE void* loadStackFallback(void** p) {
+    ThreadStack &ts = thread_stack;
+    if (ts.copy != NULL) {
+        // Nothing outside the copy is left of the stack it was taken from,
+        // and NULL ends the walk
+        uintptr_t addr = (uintptr_t)p;
+        void* value = NULL;
+        if (addr >= ts.copy_low && addr + sizeof(void*) <= ts.copy_high) {
+            memcpy(&value, ts.copy + (addr - ts.copy_low), sizeof(void*));
+        }
+        return value;
+    }
+    if (++ts.fallback >= STACK_READ_FLUSH) {
+        __atomic_fetch_add(&stack_read_stats.fallback, ts.fallback, __ATOMIC_RELAXED);
+        ts.fallback = 0;
+    }
+    return SafeAccess::load(p);
+}
+
+// Reads a word from the stack being walked
+static inline void* loadStack(void** p) {
+    ThreadStack &ts = thread_stack;
+    uintptr_t addr = (uintptr_t)p;
+    if (addr >= ts.low && addr + sizeof(void*) <= ts.high) {
+        return *p;
+    }
+    return loadStackFallback(p);
+}
 
 const intptr_t MIN_VALID_PC = 0x1000;
 const intptr_t MAX_WALK_SIZE = 0x100000;
 const intptr_t MAX_FRAME_SIZE = 0x40000;
 
-static CodeCache *findLibraryByAddress(CodeCacheArray *cache, const void* address) {
-    const int native_lib_count = cache->count();
-    for (int i = 0; i < native_lib_count; i++) {
-        if (cache->operator[](i)->contains(address)) {
-            return cache->operator[](i);
-        }
+static CodeCache *findLibraryByAddress(CodeCacheArray *cache, const void* address, uint64_t* generation = NULL) {
+    CodeCache* cc = cache->find(address, generation);
+    if (cc == NULL) {
+        // Possibly a library loaded since the last refresh
+        UnwindWorker::requestRefresh();
     }
-    return NULL;
+    return cc;
 }
 
-bool stepStackContext(StackContext &sc, CodeCacheArray *cache) {
-    FrameDesc* f;
-    CodeCache* cc = findLibraryByAddress(cache, sc.pc);
-    if (cc == NULL || (f = cc->findFrameDesc(sc.pc)) == NULL) {
-        f = &FrameDesc::default_frame;
+// Consecutive frames usually come from the same library, and often from the
+// same frame description (e.g. recursion), so each thread remembers the last
+// few lookups. The cache is only touched by its own thread, but a signal
+// handler may interrupt an update, in which case the handler doesn't use it.
+// Every entry comes from the CodeCacheArray snapshot with the cache's
+// generation, and the cache is cleared when the generation changes, so it
+// never holds a library which may have been removed.
+const int UNWIND_CACHE_SIZE = 4;
+const int UNWIND_CACHE_FLUSH = 1024;
+
+struct UnwindCacheEntry {
+    CodeCache* lib;
+    bool has_frame;
+    FrameDesc frame;
+    const void* start;
+    const void* end;
+};
+
+struct UnwindCache {
+    UnwindCacheEntry entries[UNWIND_CACHE_SIZE];
+    uint64_t generation;
+    int next;
+    int busy;
+    // Counts since the last flush to the global UnwindCacheStats
+    UnwindCacheStats local;
+};
+
+static __thread UnwindCache unwind_cache __attribute__((tls_model("initial-exec")));
+static UnwindCacheStats unwind_cache_stats;
+static bool unwind_cache_enabled = true;
+
+void setUnwindCacheEnabled(bool enabled) {
+    unwind_cache_enabled = enabled;
+}
+
+void getUnwindCacheStats(UnwindCacheStats &stats) {
+    stats.frame_hits = __atomic_load_n(&unwind_cache_stats.frame_hits, __ATOMIC_RELAXED);
+    stats.lib_hits = __atomic_load_n(&unwind_cache_stats.lib_hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&unwind_cache_stats.misses, __ATOMIC_RELAXED);
+}
+
+static void flushUnwindCacheStats(UnwindCacheStats &local) {
+    __atomic_fetch_add(&unwind_cache_stats.frame_hits, local.frame_hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&unwind_cache_stats.lib_hits, local.lib_hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&unwind_cache_stats.misses, local.misses, __ATOMIC_RELAXED);
+    local.frame_hits = local.lib_hits = local.misses = 0;
+}
+
+static void clearUnwindCache(UnwindCache &uc, uint64_t generation) {
+    for (int i = 0; i < UNWIND_CACHE_SIZE; i++) {
+        uc.entries[i].lib = NULL;
+        uc.entries[i].has_frame = false;
+    }
+    uc.generation = generation;
+}
+
+static bool findFrameDescUncached(CodeCacheArray *cache, const void* pc, FrameDesc &frame) {
+    CodeCache* cc = findLibraryByAddress(cache, pc);
+    return cc != NULL && cc->findFrameDesc(pc, frame);
+}
+
+static bool findFrameDesc(CodeCacheArray *cache, const void* pc, FrameDesc &frame) {
+    UnwindCache &uc = unwind_cache;
+    if (!unwind_cache_enabled || uc.busy) {
+        return findFrameDescUncached(cache, pc, frame);
     }
+    uc.busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    uint64_t generation = cache->generation();
+    if (generation != uc.generation) {
+        clearUnwindCache(uc, generation);
+    }
+
+    bool found = false;
+    CodeCache* cc = NULL;
+    for (int i = 0; i < UNWIND_CACHE_SIZE; i++) {
+        UnwindCacheEntry &e = uc.entries[i];
+        if (e.has_frame && pc >= e.start && pc < e.end) {
+            uc.local.frame_hits++;
+            frame = e.frame;
+            found = true;
+            goto done;
+        }
+        if (cc == NULL && e.lib != NULL && e.lib->contains(pc)) {
+            cc = e.lib;
+        }
+    }
+
+    if (cc != NULL) {
+        uc.local.lib_hits++;
+    } else {
+        uc.local.misses++;
+        cc = findLibraryByAddress(cache, pc, &generation);
+        if (generation != uc.generation) {
+            // A newer snapshot was published since the check above
+            clearUnwindCache(uc, generation);
+        }
+    }
+
+    if (cc != NULL) {
+        UnwindCacheEntry &e = uc.entries[uc.next];
+        uc.next = (uc.next + 1) % UNWIND_CACHE_SIZE;
+        e.lib = cc;
+        e.has_frame = found = cc->findFrameDesc(pc, e.frame, &e.start, &e.end);
+        if (found) {
+            frame = e.frame;
+        }
+    }
+
+done:
+    if (uc.local.frame_hits + uc.local.lib_hits + uc.local.misses >= UNWIND_CACHE_FLUSH) {
+        flushUnwindCacheStats(uc.local);
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    uc.busy = 0;
+    return found;
+}
+
+// Steps sc over a frame described by f. If slot isn't NULL, it's set to where
+// the return address was read, or NULL if it wasn't read from the stack.
+static bool applyFrameDesc(StackContext &sc, const FrameDesc* f, void*** slot = NULL) {
     uintptr_t bottom = sc.sp + MAX_WALK_SIZE;
     uintptr_t prev_sp = sc.sp;
 
@@ -69,11 +285,17 @@ bool stepStackContext(StackContext &sc, CodeCacheArray *cache) {
 
     if (f->fp_off & DW_PC_OFFSET) {
         sc.pc = (const char*)sc.pc + (f->fp_off >> 1);
+        if (slot != NULL) {
+            *slot = NULL;
+        }
     } else {
         if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
-            sc.fp = (uintptr_t)SafeAccess::load((void**)(sc.sp + f->fp_off));
+            sc.fp = (uintptr_t)loadStack((void**)(sc.sp + f->fp_off));
+        }
+        sc.pc = stripPointer(loadStack((void**)sc.sp - 1));
+        if (slot != NULL) {
+            *slot = (void**)sc.sp - 1;
         }
-        sc.pc = stripPointer(SafeAccess::load((void**)sc.sp - 1));
     }
 
     if (sc.pc < (const void*)MIN_VALID_PC || sc.pc > (const void*)-MIN_VALID_PC) {
@@ -82,6 +304,67 @@ bool stepStackContext(StackContext &sc, CodeCacheArray *cache) {
     return true;
 }
 
+static bool step(StackContext &sc, CodeCacheArray *cache, void*** slot = NULL) {
+    FrameDesc frame;
+    if (!findFrameDesc(cache, sc.pc, frame)) {
+        frame = FrameDesc::default_frame;
+    }
+    return applyFrameDesc(sc, &frame, slot);
+}
+
+bool stepStackContext(StackContext &sc, CodeCacheArray *cache) {
+    CodeCacheArray::ReadGuard guard(cache);
+    return step(sc, cache);
+}
+
+// The frame descriptions used by the last skipFrames call on this thread.
+// Frame descriptions are copies, so they stay valid after the snapshot they
+// came from is replaced, but they are dropped when the generation changes in
+// case the library they describe was unloaded.
+struct SkipMemo {
+    uint64_t generation;
+    int count;
+    const void* pc[MAX_SKIP_FRAMES];
+    FrameDesc frames[MAX_SKIP_FRAMES];
+};
+
+static __thread SkipMemo skip_memo __attribute__((tls_model("initial-exec")));
+
+bool skipFrames(StackContext &sc, CodeCacheArray *cache, int n) {
+    SkipMemo &memo = skip_memo;
+    if (n > MAX_SKIP_FRAMES) {
+        return false;
+    }
+
+    if (memo.count == n && memo.generation == cache->generation()) {
+        StackContext next = sc;
+        int i = 0;
+        while (i < n && next.pc == memo.pc[i] && applyFrameDesc(next, &memo.frames[i])) {
+            i++;
+        }
+        if (i == n) {
+            sc = next;
+            return true;
+        }
+    }
+
+    CodeCacheArray::ReadGuard guard(cache);
+    memo.count = 0;
+    memo.generation = cache->generation();
+    for (int i = 0; i < n; i++) {
+        FrameDesc &frame = memo.frames[i];
+        if (!findFrameDesc(cache, sc.pc, frame)) {
+            frame = FrameDesc::default_frame;
+        }
+        memo.pc[i] = sc.pc;
+        if (!applyFrameDesc(sc, &frame)) {
+            return false;
+        }
+    }
+    memo.count = n;
+    return true;
+}
+
 void populateStackContext(StackContext &sc, void *ucontext) {
     if (ucontext == NULL) {
         sc.pc = __builtin_return_address(0);
@@ -95,19 +378,321 @@ void populateStackContext(StackContext &sc, void *ucontext) {
     }
 }
 
-int stackWalk(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth, int skip) {
+// The stop ranges, sorted by address. A table is never modified once
+// published, and is never freed, since a signal handler may still be using
+// it. Tables are only replaced when a Go runtime is found, so few are ever
+// allocated.
+struct StopRange {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+struct StopTable {
+    int count;
+    StopRange ranges[0];
+};
+
+static StopTable empty_stop_table = {};
+static StopTable* stop_table = &empty_stop_table;
+static pthread_mutex_t stop_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool isStopAddress(const StopTable* table, uintptr_t pc) {
+    // There's normally one range per Go runtime, so a scan beats a search
+    for (int i = 0; i < table->count && table->ranges[i].start <= pc; i++) {
+        if (pc < table->ranges[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void addStopRange(const void* start, const void* end) {
+    StopRange range = {(uintptr_t)start, (uintptr_t)end};
+    if (range.start >= range.end) {
+        return;
+    }
+
+    pthread_mutex_lock(&stop_table_lock);
+    StopTable* old = stop_table;
+    int i = 0;
+    while (i < old->count && old->ranges[i].start < range.start) {
+        i++;
+    }
+    bool present = i < old->count && old->ranges[i].start == range.start;
+    StopTable* table = present ? NULL : (StopTable*)malloc(sizeof(StopTable) + (old->count + 1) * sizeof(StopRange));
+    if (table != NULL) {
+        memcpy(table->ranges, old->ranges, i * sizeof(StopRange));
+        table->ranges[i] = range;
+        memcpy(table->ranges + i + 1, old->ranges + i, (old->count - i) * sizeof(StopRange));
+        table->count = old->count + 1;
+        __atomic_store_n(&stop_table, table, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stop_table_lock);
+}
+
+void addGoRuntimeStopRanges(CodeCache* cc) {
+    // asmcgocall has the "abi0" suffix on recent Go versions, but not on
+    // older ones
+    const void* p = cc->findSymbol("runtime.asmcgocall.abi0");
+    if (p == NULL) {
+        p = cc->findSymbol("runtime.asmcgocall");
+    }
+    CodeBlob* blob = p != NULL ? cc->find(p) : NULL;
+    // Symbols of non-PIE executables don't get the right addresses, but
+    // the Go side of each runtime that imports this package adds its own
+    if (blob != NULL && cc->contains(blob->_start)) {
+        addStopRange(blob->_start, blob->_end);
+    }
+}
+
+int stackWalk(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth, int skip,
+              void*** slots, int max_slots) {
     int depth = -skip;
+    CodeCacheArray::ReadGuard guard(cache);
+    const StopTable* stop = __atomic_load_n(&stop_table, __ATOMIC_ACQUIRE);
+    void** slot = NULL;
 
-    // Walk until the bottom of the stack or until the first Java frame
+    // Walk until the bottom of the stack or until a stop range, such as
+    // the asmcgocall frame which begins the C part of the stack
     while (depth < max_depth) {
         int d = depth++;
         if (d >= 0) {
             callchain[d] = (uintptr_t) sc.pc;
+            if (d < max_slots) {
+                slots[d] = slot;
+            }
         }
-        if (!stepStackContext(sc, cache)) {
+        if (isStopAddress(stop, (uintptr_t) sc.pc) || !step(sc, cache, &slot)) {
 	        break;
         }
     }
 
     return depth;
 }
+
+// The granularity at which copyStack checks that a stack it doesn't know the
+// bounds of can be read. Pages are at least this big.
+const uintptr_t COPY_PROBE_SIZE = 4096;
+
+size_t copyStack(uintptr_t sp, void* dst, size_t len) {
+    ThreadStack &ts = thread_stack;
+    if (sp >= ts.low && sp < ts.high) {
+        size_t n = ts.high - sp < len ? ts.high - sp : len;
+        memcpy(dst, (const void*)sp, n);
+        return n;
+    }
+
+    // Read the first word of each page with SafeAccess::load, and if it
+    // doesn't fault, the rest of the page can be copied. A fault on another
+    // thread meanwhile also ends the copy, which only makes it shorter.
+    size_t copied = 0;
+    while (copied < len) {
+        uintptr_t addr = sp + copied;
+        uintptr_t page_end = (addr | (COPY_PROBE_SIZE - 1)) + 1;
+        uint64_t faults = SafeAccess::faults();
+        SafeAccess::load((void**)addr);
+        if (SafeAccess::faults() != faults) {
+            break;
+        }
+        size_t n = page_end - addr < len - copied ? page_end - addr : len - copied;
+        memcpy((char*)dst + copied, (const void*)addr, n);
+        copied += n;
+    }
+    return copied;
+}
+
+int stackWalkCopy(CodeCacheArray *cache, StackContext &sc, const void* copy, uintptr_t base, size_t len,
+                  uintptr_t *callchain, int max_depth) {
+    ThreadStack &ts = thread_stack;
+    uintptr_t low = ts.low;
+    uintptr_t high = ts.high;
+    ts.high = 0;
+    ts.low = 0;
+    ts.copy_low = base;
+    ts.copy_high = base + len;
+    ts.copy = (const char*)copy;
+
+    int depth = stackWalk(cache, sc, callchain, max_depth, 0);
+
+    ts.copy = NULL;
+    ts.low = low;
+    ts.high = high;
+    return depth;
+}
+
+int stackWalkFP(StackContext &sc, uintptr_t *callchain, int max_depth, void*** slots, int max_slots) {
+    const StopTable* stop = __atomic_load_n(&stop_table, __ATOMIC_ACQUIRE);
+    void** slot = NULL;
+    int depth = 0;
+    while (depth < max_depth) {
+        int d = depth++;
+        callchain[d] = (uintptr_t) sc.pc;
+        if (d < max_slots) {
+            slots[d] = slot;
+        }
+        if (isStopAddress(stop, (uintptr_t) sc.pc) || !applyFrameDesc(sc, &FrameDesc::default_frame, &slot)) {
+            break;
+        }
+    }
+    return depth;
+}
+
+bool inStopRange(const void* pc) {
+    return isStopAddress(__atomic_load_n(&stop_table, __ATOMIC_ACQUIRE), (uintptr_t) pc);
+}
+
+bool framesUnchanged(const uintptr_t* callchain, void** const* slots, int count) {
+    for (int i = 0; i < count; i++) {
+        if (slots[i] != NULL && (uintptr_t)stripPointer(loadStack(slots[i])) != callchain[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The last call stack walked by stackWalkMemo on this thread. Frames are in
+// walk order, so by increasing stack pointer. Each frame after the first has
+// the stack pointer after the step which found it, and the slot its return
+// address was read from.
+//
+// A later walk which steps to a frame with the same stack pointer and return
+// address as a frame in the memo can take the rest of the call stack from
+// the memo, if the return addresses of the older frames are all still in
+// their slots. Since frames are only pushed and popped below the stack
+// pointer, the memo is dropped once a walk starts above its outermost frame,
+// as none of its frames can still be live.
+//
+// Initial-exec TLS is taken from the static TLS block, which is limited for a
+// dlopened library, so the memo only covers as many frames as the runtime
+// takes for a profiling signal's C call stack. Deeper walks still work, but
+// are only matched within their first STACK_MEMO_FRAMES frames.
+const int STACK_MEMO_FRAMES = 32;
+
+struct MemoFrame {
+    uintptr_t sp;
+    const void* pc;
+    void** slot;
+};
+
+struct StackMemo {
+    MemoFrame frames[STACK_MEMO_FRAMES];
+    int count;
+    // The walk ended at the last frame, rather than at the depth limit or
+    // because the memo was full
+    bool complete;
+    uint64_t generation;
+    const StopTable* stop;
+    int busy;
+};
+
+static __thread StackMemo stack_memo __attribute__((tls_model("initial-exec")));
+static bool stack_memo_enabled = true;
+static StackMemoStats stack_memo_stats;
+
+void setStackMemoEnabled(bool enabled) {
+    stack_memo_enabled = enabled;
+}
+
+void getStackMemoStats(StackMemoStats &stats) {
+    stats.hits = __atomic_load_n(&stack_memo_stats.hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&stack_memo_stats.misses, __ATOMIC_RELAXED);
+}
+
+// Returns the index of the memo frame matching sc, which was just stepped to
+// with its return address read from slot, if the memo has the next needed
+// frames from it. cursor is the first frame not below sc.
+static int findMemoFrame(const StackMemo &memo, int &cursor, const StackContext &sc, void** slot, int needed) {
+    while (cursor < memo.count && memo.frames[cursor].sp < sc.sp) {
+        cursor++;
+    }
+    if (slot == NULL || cursor >= memo.count) {
+        return -1;
+    }
+    const MemoFrame &f = memo.frames[cursor];
+    if (f.sp != sc.sp || f.pc != sc.pc || f.slot != slot) {
+        return -1;
+    }
+    int available = memo.count - cursor;
+    if (available < needed && !memo.complete) {
+        return -1;
+    }
+    int end = available < needed ? memo.count : cursor + needed;
+    for (int i = cursor + 1; i < end; i++) {
+        const MemoFrame &older = memo.frames[i];
+        if (older.slot != NULL && stripPointer(loadStack(older.slot)) != older.pc) {
+            return -1;
+        }
+    }
+    return cursor;
+}
+
+int stackWalkMemo(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth) {
+    StackMemo &memo = stack_memo;
+    if (!stack_memo_enabled || memo.busy) {
+        return stackWalk(cache, sc, callchain, max_depth, 0);
+    }
+    memo.busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    CodeCacheArray::ReadGuard guard(cache);
+    const StopTable* stop = __atomic_load_n(&stop_table, __ATOMIC_ACQUIRE);
+    uint64_t generation = cache->generation();
+    if (memo.generation != generation || memo.stop != stop ||
+        memo.count == 0 || sc.sp > memo.frames[memo.count - 1].sp) {
+        memo.count = 0;
+    }
+
+    MemoFrame fresh[STACK_MEMO_FRAMES];
+    void** slot = NULL;
+    int depth = 0;
+    int cursor = 1;
+    int match = -1;
+    bool complete = false;
+    while (depth < max_depth) {
+        int d = depth++;
+        callchain[d] = (uintptr_t) sc.pc;
+        if (d < STACK_MEMO_FRAMES) {
+            fresh[d].sp = sc.sp;
+            fresh[d].pc = sc.pc;
+            fresh[d].slot = slot;
+        }
+        if (isStopAddress(stop, (uintptr_t) sc.pc) || !step(sc, cache, &slot)) {
+            complete = true;
+            break;
+        }
+        if (depth < max_depth && depth < STACK_MEMO_FRAMES) {
+            match = findMemoFrame(memo, cursor, sc, slot, max_depth - depth);
+            if (match >= 0) {
+                break;
+            }
+        }
+    }
+
+    if (match >= 0) {
+        int suffix = memo.count - match;
+        int n = suffix < max_depth - depth ? suffix : max_depth - depth;
+        for (int i = 0; i < n; i++) {
+            callchain[depth + i] = (uintptr_t) memo.frames[match + i].pc;
+        }
+        // The new memo is the frames just walked followed by the old suffix
+        int keep = suffix < STACK_MEMO_FRAMES - depth ? suffix : STACK_MEMO_FRAMES - depth;
+        memmove(memo.frames + depth, memo.frames + match, keep * sizeof(MemoFrame));
+        memcpy(memo.frames, fresh, depth * sizeof(MemoFrame));
+        memo.complete = memo.complete && keep == suffix;
+        memo.count = depth + keep;
+        depth += n;
+        __atomic_fetch_add(&stack_memo_stats.hits, 1, __ATOMIC_RELAXED);
+    } else {
+        int count = depth < STACK_MEMO_FRAMES ? depth : STACK_MEMO_FRAMES;
+        memcpy(memo.frames, fresh, count * sizeof(MemoFrame));
+        memo.complete = complete && depth <= STACK_MEMO_FRAMES;
+        memo.count = count;
+        __atomic_fetch_add(&stack_memo_stats.misses, 1, __ATOMIC_RELAXED);
+    }
+    memo.generation = generation;
+    memo.stop = stop;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    memo.busy = 0;
+    return depth;
+}
@@ -36,6 +36,107 @@ struct StackContext {
     }
 };
 
-int stackWalk(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth, int skip);
+// Walks the stack, recording up to max_depth return addresses after skipping
+// the first skip. Stops after recording an address in a stop range. For the
+// first max_slots recorded frames, also records where on the stack their
+// return address was read, or NULL if it wasn't, which can be used to check
+// that the frames are still on the stack later on.
+int stackWalk(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth, int skip,
+              void*** slots = NULL, int max_slots = 0);
+
+// Finds the bounds of the calling thread's stack, so that walks on the thread
+// read its stack with plain loads rather than through SafeAccess::load, which
+// relies on recovering from faults. Cheap after the first call on a thread.
+// Not signal safe, so it's called when a thread starts, on the way into Go
+// code and at startup rather than while handling a profiling signal.
+void cacheThreadStackBounds();
+
+// Returns whether the calling thread's stack bounds are cached
+bool threadStackBoundsCached();
+
+// Counts reads from the stack during walks which weren't within the thread's
+// cached stack bounds. Counts are collected per thread and added to the
+// totals in batches, so recent reads may not be reflected.
+struct StackReadStats {
+    // Reads through SafeAccess::load
+    uint64_t fallback;
+    // Reads through SafeAccess::load which faulted
+    uint64_t faults;
+};
+
+void getStackReadStats(StackReadStats &stats);
+
+// Copies up to len bytes of the calling thread's stack from sp to dst, and
+// returns how many were copied. The copy stops at the end of the thread's
+// cached stack bounds, or if they aren't known, at the first page which can't
+// be read. Signal safe.
+size_t copyStack(uintptr_t sp, void* dst, size_t len);
+
+// Like stackWalk, but walks a copy of a stack taken earlier with copyStack,
+// possibly on another thread. The copy holds the len bytes which were at
+// base, at or below sc.sp, and the walk ends at anything outside it. The
+// calling thread must not walk its own stack meanwhile, e.g. in a profiling
+// signal handler.
+int stackWalkCopy(CodeCacheArray *cache, StackContext &sc, const void* copy, uintptr_t base, size_t len,
+                  uintptr_t *callchain, int max_depth);
+
+// Like stackWalk, but only follows the frame pointer chain, as if no library
+// had unwind tables. Signal safe.
+int stackWalkFP(StackContext &sc, uintptr_t *callchain, int max_depth, void*** slots = NULL, int max_slots = 0);
+
+// Returns whether pc is in a stop range, where unwinding stops. Signal safe.
+bool inStopRange(const void* pc);
+
+// Returns whether the return addresses of frames recorded by stackWalk are
+// still in the slots they were read from. Signal safe.
+bool framesUnchanged(const uintptr_t* callchain, void** const* slots, int count);
+
+// Like stackWalk, but for call stacks which change little from one walk to
+// the next on the same thread, such as those sampled by a profiler. Once a
+// walk reaches a frame seen by the last walk on the thread, and the older
+// frames are unchanged, the rest of the call stack is copied from the last
+// walk. Signal safe.
+int stackWalkMemo(CodeCacheArray *cache, StackContext &sc, uintptr_t *callchain, int max_depth);
+
+// Counts walks by stackWalkMemo which did and didn't reuse the last walk
+struct StackMemoStats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void getStackMemoStats(StackMemoStats &stats);
+void setStackMemoEnabled(bool enabled);
+
+// The most frames skipFrames can skip
+#define MAX_SKIP_FRAMES 2
+
+// Unwinds n frames from sc. The frame descriptions are remembered per
+// thread, and reused without any lookup if the next call on the thread
+// starts from the same pc and finds the same return addresses. Meant for
+// skipping the same few frames over and over, such as when capturing a
+// cgo_context. Not signal safe.
+bool skipFrames(StackContext &sc, CodeCacheArray *cache, int n);
+
+// Adds [start, end) to the stop ranges, such as runtime.asmcgocall, where the
+// C part of a call stack begins. Ranges are never removed. Not signal safe.
+void addStopRange(const void* start, const void* end);
+
+// Adds the stop ranges of the Go runtime in a library, found by symbol name,
+// if it has one and its symbols were loaded. Not signal safe.
+void addGoRuntimeStopRanges(CodeCache* cc);
+
+// Hit counters for the per-thread cache of library and frame description
+// lookups used while unwinding. Counts are collected per thread and added to
+// the totals in batches, so recent lookups may not be reflected yet.
+struct UnwindCacheStats {
+    // The frame description for the pc was cached
+    uint64_t frame_hits;
+    // The library for the pc was cached, but not the frame description
+    uint64_t lib_hits;
+    uint64_t misses;
+};
+
+void getUnwindCacheStats(UnwindCacheStats &stats);
+void setUnwindCacheEnabled(bool enabled);
 
 #endif // _STACKWALKER_H
@@ -17,17 +17,97 @@
 #ifndef _SYMBOLS_H
 #define _SYMBOLS_H
 
+#include <string.h>
 #include "codeCache.h"
 
+// When to build each library's unwind table
+enum DwarfMode {
+    // When the library is parsed
+    DWARF_EAGER,
+    // By the UnwindWorker, the first time an unwind reaches the library.
+    // Until then, call stacks in the library are unwound with frame pointers.
+    DWARF_LAZY,
+    // Never. Frame descriptions are decoded from .eh_frame_hdr on each
+    // lookup, and recently decoded ones are kept in the FdeCache.
+    DWARF_ON_DEMAND
+};
+
+#if defined(CGOTRACEBACK_ONDEMAND_DWARF)
+const DwarfMode DWARF_MODE_DEFAULT = DWARF_ON_DEMAND;
+#elif defined(CGOTRACEBACK_LAZY_DWARF)
+const DwarfMode DWARF_MODE_DEFAULT = DWARF_LAZY;
+#else
+const DwarfMode DWARF_MODE_DEFAULT = DWARF_EAGER;
+#endif
+
+// Which symbols to load into each library's CodeCache
+enum SymbolMode {
+    // Every symbol, plus synthesized names for PLT stubs
+    SYMBOLS_ALL,
+    // No symbols, since the unwinder itself doesn't need any. Symbolization
+    // is done by dladdr or libdwfl instead, so this saves reading symbol
+    // tables and external debug files altogether.
+    SYMBOLS_NONE
+};
+
+#if defined(CGOTRACEBACK_UNWIND_ONLY)
+const SymbolMode SYMBOL_MODE_DEFAULT = SYMBOLS_NONE;
+#else
+const SymbolMode SYMBOL_MODE_DEFAULT = SYMBOLS_ALL;
+#endif
+
+// Upper bound on the default number of threads parsing libraries
+const int MAX_PARSE_THREADS = 8;
+
 
 class Symbols {
   private:
     static bool _have_kernel_symbols;
+    static DwarfMode _dwarf_mode;
+    static SymbolMode _symbol_mode;
+    static int _parse_threads;
 
   public:
+    // Defaults to DWARF_LAZY if built with the use_lazy_dwarf tag, and
+    // DWARF_ON_DEMAND with the use_ondemand_dwarf tag
+    static void setDwarfMode(DwarfMode mode) {
+        _dwarf_mode = mode;
+    }
+
+    static DwarfMode dwarfMode() {
+        return _dwarf_mode;
+    }
+
+    // Defaults to SYMBOLS_NONE if built with the use_unwind_only tag
+    static void setSymbolMode(SymbolMode mode) {
+        _symbol_mode = mode;
+    }
+
+    static SymbolMode symbolMode() {
+        return _symbol_mode;
+    }
+
+    // The number of threads parseLibraries uses, including the calling one.
+    // Zero, the default, means one per CPU up to MAX_PARSE_THREADS.
+    static void setParseThreads(int threads) {
+        _parse_threads = threads;
+    }
+
+    static int parseThreads();
+
     static void parseKernelSymbols(CodeCache* cc);
+    // Parses the libraries loaded since the last call into the array, and
+    // removes the ones which have been unloaded
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols);
 
+    // Builds the library's unwind table if it is still loaded, and returns
+    // whether it was. The loader can't unload it in the meantime.
+    static bool parseDwarfTableIfLoaded(CodeCache* cc);
+
+    // Whether libraries have been loaded or unloaded since the last call.
+    // Cheap enough to poll, but not signal safe.
+    static bool librariesChanged();
+
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
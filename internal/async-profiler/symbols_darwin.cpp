@@ -20,12 +20,14 @@
 #ifdef __APPLE__
 
 #include <set>
+#include <vector>
 #include <dlfcn.h>
 #include <string.h>
 #include <mach-o/dyld.h>
 #include <mach-o/loader.h>
 #include <mach-o/nlist.h>
 #include "symbols.h"
+#include "stackWalker.h"
 
 
 class MachOParser {
@@ -102,7 +104,9 @@ class MachOParser {
                 if (text_base == UNDEFINED || link_base == UNDEFINED) {
                     return false;
                 }
-                loadSymbols((const symtab_command*)lc, text_base, link_base);
+                if (Symbols::symbolMode() == SYMBOLS_ALL) {
+                    loadSymbols((const symtab_command*)lc, text_base, link_base);
+                }
                 break;
             }
             lc = (const load_command*)add(lc, lc->cmdsize);
@@ -114,34 +118,78 @@ class MachOParser {
 
 
 bool Symbols::_have_kernel_symbols = false;
+DwarfMode Symbols::_dwarf_mode = DWARF_MODE_DEFAULT;
+SymbolMode Symbols::_symbol_mode = SYMBOL_MODE_DEFAULT;
+int Symbols::_parse_threads = 0;
+
+int Symbols::parseThreads() {
+    // Images are parsed serially on macOS
+    return 1;
+}
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
 }
 
+// Counts images added and removed, as reported by dyld
+static volatile uint64_t image_events = 0;
+static uint64_t last_image_events = 0;
+
+static void countImageEvent(const mach_header* mh, intptr_t slide) {
+    __atomic_fetch_add(&image_events, 1, __ATOMIC_RELAXED);
+}
+
+bool Symbols::parseDwarfTableIfLoaded(CodeCache* cc) {
+    // Images have no .eh_frame_hdr to build a table from, and the
+    // UnwindWorker which builds tables lazily only runs on Linux
+    cc->parseDwarfTable();
+    return true;
+}
+
+bool Symbols::librariesChanged() {
+    static bool registered = false;
+    if (!registered) {
+        // dyld calls the add callback for every image already loaded
+        _dyld_register_func_for_add_image(countImageEvent);
+        _dyld_register_func_for_remove_image(countImageEvent);
+        registered = true;
+    }
+    uint64_t events = __atomic_load_n(&image_events, __ATOMIC_RELAXED);
+    bool changed = events != last_image_events;
+    last_image_events = events;
+    return changed;
+}
+
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
-    static std::set<const void*> _parsed_libraries;
+    static int next_lib_index = 0;
+    std::set<const void*> parsed_libraries;
+    std::set<CodeCache*> kept;
+    std::vector<CodeCache*> added;
     uint32_t images = _dyld_image_count();
 
+    array->lock();
+    int existing = array->count();
+
     for (uint32_t i = 0; i < images; i++) {
         const mach_header* image_base = _dyld_get_image_header(i);
-        if (image_base == NULL || !_parsed_libraries.insert(image_base).second) {
+        if (image_base == NULL || !parsed_libraries.insert(image_base).second) {
             continue;  // the library was already parsed
         }
 
-        int count = array->count();
-        if (count >= MAX_NATIVE_LIBS) {
-            break;
-        }
-
         const char* path = _dyld_get_image_name(i);
 
+        CodeCache* existing_cc = array->find(image_base);
+        if (existing_cc != NULL && strcmp(existing_cc->name(), path) == 0) {
+            kept.insert(existing_cc);
+            continue;
+        }
+
         // Protect the library from unloading while parsing symbols
         void* handle = dlopen(path, RTLD_LAZY | RTLD_NOLOAD);
         if (handle == NULL) {
             continue;
         }
 
-        CodeCache* cc = new CodeCache(path, count);
+        CodeCache* cc = new CodeCache(path, next_lib_index++);
         MachOParser parser(cc, image_base);
         if (!parser.parse()) {
             //Log::warn("Could not parse symbols from %s", path);
@@ -149,8 +197,21 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
         dlclose(handle);
 
         cc->sort();
-        array->add(cc);
+        addGoRuntimeStopRanges(cc);
+        added.push_back(cc);
+    }
+
+    std::vector<CodeCache*> removed;
+    for (int i = 0; i < existing; i++) {
+        if (kept.find((*array)[i]) == kept.end()) {
+            removed.push_back((*array)[i]);
+        }
+    }
+
+    if (!added.empty() || !removed.empty()) {
+        array->update(added.data(), (int)added.size(), removed.data(), (int)removed.size());
     }
+    array->unlock();
 }
 
 #endif // __APPLE__
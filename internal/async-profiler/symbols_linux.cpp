@@ -20,19 +20,28 @@
 #ifdef __linux__
 
 #include <set>
+#include <vector>
+#include <link.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/auxv.h>
 #include <elf.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include "symbols.h"
 #include "dwarf.h"
+#include "persistentCache.h"
+#include "stackWalker.h"
 
 
 class SymbolDesc {
@@ -142,12 +151,33 @@ class ElfParser {
     ElfHeader* _header;
     const char* _sections;
 
+    // When parsing a file rather than an image in memory, only the headers
+    // are read, and each section is mapped separately when first used. The
+    // mappings are unmapped when done, unless kept because symbol names
+    // point into them.
+    struct SectionMapping {
+        ElfSection* section;
+        const char* data;
+        void* addr;
+        size_t size;
+        bool keep;
+    };
+    static const int MAX_SECTION_MAPPINGS = 8;
+
+    int _fd;
+    size_t _file_size;
+    SectionMapping _section_mappings[MAX_SECTION_MAPPINGS];
+    int _section_mapping_count;
+
     ElfParser(CodeCache* cc, const char* base, const void* addr, const char* file_name = NULL) {
         _cc = cc;
         _base = base;
         _file_name = file_name;
         _header = (ElfHeader*)addr;
         _sections = (const char*)addr + _header->e_shoff;
+        _fd = -1;
+        _file_size = 0;
+        _section_mapping_count = 0;
     }
 
     bool validHeader() {
@@ -161,10 +191,18 @@ class ElfParser {
         return (ElfSection*)(_sections + index * _header->e_shentsize);
     }
 
+    // Returns NULL if a section of a file can't be mapped
     const char* at(ElfSection* section) {
-        return (const char*)_header + section->sh_offset;
+        if (_fd == -1) {
+            return (const char*)_header + section->sh_offset;
+        }
+        return mapSection(section);
     }
 
+    const char* mapSection(ElfSection* section);
+    void keepSection(ElfSection* section);
+    void releaseSections();
+
     const char* at(ElfProgramHeader* pheader) {
         return _header->e_type == ET_EXEC ? (const char*)pheader->p_vaddr : (const char*)_header + pheader->p_vaddr;
     }
@@ -184,11 +222,15 @@ class ElfParser {
     static void parseProgramHeaders(CodeCache* cc, const char* base);
     static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
     static void parseMem(CodeCache* cc, const char* base);
+    static const char* findBuildId(const char* base, int* length);
 };
 
 
 ElfSection* ElfParser::findSection(uint32_t type, const char* name) {
     const char* strtab = at(section(_header->e_shstrndx));
+    if (strtab == NULL) {
+        return NULL;
+    }
 
     for (int i = 0; i < _header->e_shnum; i++) {
         ElfSection* section = this->section(i);
@@ -215,25 +257,89 @@ ElfProgramHeader* ElfParser::findProgramHeader(uint32_t type) {
     return NULL;
 }
 
+const char* ElfParser::mapSection(ElfSection* section) {
+    for (int i = 0; i < _section_mapping_count; i++) {
+        if (_section_mappings[i].section == section) {
+            return _section_mappings[i].data;
+        }
+    }
+
+    if (section->sh_type == SHT_NOBITS || section->sh_size == 0 || section->sh_offset > _file_size
+            || section->sh_size > _file_size - section->sh_offset
+            || _section_mapping_count == MAX_SECTION_MAPPINGS) {
+        return NULL;
+    }
+
+    size_t page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    size_t offset = section->sh_offset & ~page_mask;
+    size_t size = section->sh_offset + section->sh_size - offset;
+    void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, _fd, offset);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    SectionMapping& m = _section_mappings[_section_mapping_count++];
+    m.section = section;
+    m.data = (const char*)addr + (section->sh_offset - offset);
+    m.addr = addr;
+    m.size = size;
+    m.keep = false;
+    return m.data;
+}
+
+void ElfParser::keepSection(ElfSection* section) {
+    for (int i = 0; i < _section_mapping_count; i++) {
+        if (_section_mappings[i].section == section) {
+            _section_mappings[i].keep = true;
+        }
+    }
+}
+
+void ElfParser::releaseSections() {
+    for (int i = 0; i < _section_mapping_count; i++) {
+        SectionMapping& m = _section_mappings[i];
+        if (m.keep) {
+            _cc->addMapping(m.addr, m.size);
+        } else {
+            munmap(m.addr, m.size);
+        }
+    }
+    _section_mapping_count = 0;
+}
+
 bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug) {
     int fd = open(file_name, O_RDONLY);
     if (fd == -1) {
         return false;
     }
 
-    size_t length = (size_t)lseek64(fd, 0, SEEK_END);
-    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-
-    if (addr == MAP_FAILED) {
-        //Log::warn("Could not parse symbols from %s: %s", file_name, strerror(errno));
-    } else {
-        ElfParser elf(cc, base, addr, file_name);
-        if (elf.validHeader()) {
-            elf.loadSymbols(use_debug);
+    // Read only the headers here rather than mapping the whole file, which
+    // may be a debuginfo file of several gigabytes. Sections are mapped as
+    // they're used.
+    struct stat st;
+    ElfHeader header;
+    if (fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+        ElfParser elf(cc, base, &header, file_name);
+        size_t sections_size = (size_t)header.e_shnum * header.e_shentsize;
+        if (elf.validHeader() && header.e_shoff <= (size_t)st.st_size
+                && sections_size <= (size_t)st.st_size - header.e_shoff
+                && header.e_shstrndx < header.e_shnum) {
+            char* sections = (char*)malloc(sections_size);
+            if (sections != NULL && pread(fd, sections, sections_size, header.e_shoff) == (ssize_t)sections_size) {
+                elf._sections = sections;
+                elf._fd = fd;
+                elf._file_size = st.st_size;
+                elf.loadSymbols(use_debug);
+                // Symbol names point into the string table, so its mapping
+                // is kept. Its pages are shared with other processes through
+                // the page cache.
+                elf.releaseSections();
+            }
+            free(sections);
         }
-        munmap(addr, length);
     }
+
+    close(fd);
     return true;
 }
 
@@ -253,6 +359,36 @@ void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base) {
     }
 }
 
+// Returns the build ID of a loaded library, from its PT_NOTE segments
+const char* ElfParser::findBuildId(const char* base, int* length) {
+    ElfParser elf(NULL, base, base);
+    if (!elf.validHeader()) {
+        return NULL;
+    }
+
+    const char* pheaders = (const char*)elf._header + elf._header->e_phoff;
+    for (int i = 0; i < elf._header->e_phnum; i++) {
+        ElfProgramHeader* pheader = (ElfProgramHeader*)(pheaders + i * elf._header->e_phentsize);
+        if (pheader->p_type != PT_NOTE) {
+            continue;
+        }
+        const char* note_start = elf.at(pheader);
+        const char* note_end = note_start + pheader->p_memsz;
+        while (note_start + sizeof(ElfNote) <= note_end) {
+            ElfNote* note = (ElfNote*)note_start;
+            const char* name = note_start + sizeof(ElfNote);
+            const char* desc = name + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0
+                    && desc + note->n_descsz <= note_end) {
+                *length = note->n_descsz;
+                return desc;
+            }
+            note_start = desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+    return NULL;
+}
+
 void ElfParser::parseDynamicSection() {
     ElfProgramHeader* dynamic = findProgramHeader(PT_DYNAMIC);
     if (dynamic != NULL) {
@@ -327,8 +463,20 @@ void ElfParser::parseDwarfInfo() {
 
     ElfProgramHeader* eh_frame_hdr = findProgramHeader(PT_GNU_EH_FRAME);
     if (eh_frame_hdr != NULL) {
-        DwarfParser dwarf(_cc->name(), _base, at(eh_frame_hdr));
-        _cc->setDwarfTable(dwarf.table(), dwarf.count());
+        _cc->setEhFrameHdr(at(eh_frame_hdr));
+        if (_cc->unwindTable() != NULL) {
+            return;  // loaded from the PersistentCache
+        }
+        switch (Symbols::dwarfMode()) {
+            case DWARF_EAGER:
+                _cc->parseDwarfTable();
+                break;
+            case DWARF_LAZY:
+                break;
+            case DWARF_ON_DEMAND:
+                _cc->setDwarfOnDemand();
+                break;
+        }
     }
 }
 
@@ -375,7 +523,7 @@ bool ElfParser::loadSymbolsUsingBuildId() {
     }
 
     ElfNote* note = (ElfNote*)at(section);
-    if (note->n_namesz != 4 || note->n_descsz < 2 || note->n_descsz > 64) {
+    if (note == NULL || note->n_namesz != 4 || note->n_descsz < 2 || note->n_descsz > 64) {
         return false;
     }
 
@@ -399,8 +547,9 @@ bool ElfParser::loadSymbolsUsingDebugLink() {
         return false;
     }
 
+    const char* debuglink = at(section);
     const char* basename = strrchr(_file_name, '/');
-    if (basename == NULL) {
+    if (debuglink == NULL || basename == NULL) {
         return false;
     }
 
@@ -409,7 +558,6 @@ bool ElfParser::loadSymbolsUsingDebugLink() {
         return false;
     }
 
-    const char* debuglink = at(section);
     char path[PATH_MAX];
     bool result = false;
 
@@ -434,30 +582,52 @@ bool ElfParser::loadSymbolsUsingDebugLink() {
 }
 
 void ElfParser::loadSymbolTable(ElfSection* symtab) {
+    if (symtab->sh_link >= _header->e_shnum || symtab->sh_entsize == 0) {
+        return;
+    }
     ElfSection* strtab = section(symtab->sh_link);
     const char* strings = at(strtab);
-
     const char* symbols = at(symtab);
+    if (strings == NULL || symbols == NULL) {
+        return;
+    }
+
+    bool mapped_names = false;
     const char* symbols_end = symbols + symtab->sh_size;
     for (; symbols < symbols_end; symbols += symtab->sh_entsize) {
         ElfSymbol* sym = (ElfSymbol*)symbols;
         if (sym->st_name != 0 && sym->st_value != 0) {
             // Skip special AArch64 mapping symbols: $x and $d
-            if (sym->st_size != 0 || sym->st_info != 0 || strings[sym->st_name] != '$') {
-                _cc->add(_base + sym->st_value, (int)sym->st_size, strings + sym->st_name);
+            if (sym->st_size == 0 && sym->st_info == 0 && strings[sym->st_name] == '$') {
+                continue;
             }
+            _cc->addMapped(_base + sym->st_value, (int)sym->st_size, strings + sym->st_name);
+            mapped_names = true;
         }
     }
+
+    if (mapped_names) {
+        keepSection(strtab);
+    }
 }
 
 void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
+    if (reltab->sh_link >= _header->e_shnum || reltab->sh_entsize == 0) {
+        return;
+    }
     ElfSection* symtab = section(reltab->sh_link);
-    const char* symbols = at(symtab);
-
+    if (symtab->sh_link >= _header->e_shnum) {
+        return;
+    }
     ElfSection* strtab = section(symtab->sh_link);
-    const char* strings = at(strtab);
 
+    const char* symbols = at(symtab);
+    const char* strings = at(strtab);
     const char* relocations = at(reltab);
+    if (symbols == NULL || strings == NULL || relocations == NULL) {
+        return;
+    }
+
     const char* relocations_end = relocations + reltab->sh_size;
     for (; relocations < relocations_end; relocations += reltab->sh_entsize) {
         ElfRelocation* r = (ElfRelocation*)relocations;
@@ -479,12 +649,351 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 
 
 bool Symbols::_have_kernel_symbols = false;
+DwarfMode Symbols::_dwarf_mode = DWARF_MODE_DEFAULT;
+SymbolMode Symbols::_symbol_mode = SYMBOL_MODE_DEFAULT;
+int Symbols::_parse_threads = 0;
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
     // XXX(nick): omitted
 }
 
-void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
+// An executable segment of a library, to be parsed by one of the workers
+struct LibraryJob {
+    CodeCache* cc;
+    const char* image_base;
+    bool parse_file;
+    bool parse_program_headers;
+    bool parse_mem;
+};
+
+struct LibraryJobs {
+    std::vector<LibraryJob>* jobs;
+    size_t next;
+};
+
+static void* parseLibraryJobs(void* arg) {
+    LibraryJobs* jobs = (LibraryJobs*)arg;
+    size_t count = jobs->jobs->size();
+    size_t i;
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < count) {
+        LibraryJob& job = (*jobs->jobs)[i];
+        CodeCache* cc = job.cc;
+
+        const char* build_id = NULL;
+        int build_id_len = 0;
+        int cached = 0;
+        if (job.parse_program_headers && job.parse_file && PersistentCache::enabled()) {
+            build_id = ElfParser::findBuildId(job.image_base, &build_id_len);
+            if (build_id != NULL) {
+                cached = PersistentCache::load(cc, job.image_base, build_id, build_id_len);
+            }
+        }
+
+        if (job.parse_program_headers) {
+            ElfParser::parseProgramHeaders(cc, job.image_base);
+        }
+        bool load_symbols = Symbols::symbolMode() == SYMBOLS_ALL;
+        if (job.parse_file && load_symbols && !(cached & PersistentCache::CACHED_SYMBOLS)) {
+            ElfParser::parseFile(cc, job.image_base, cc->name(), true);
+        }
+        if (job.parse_mem && load_symbols) {
+            ElfParser::parseMem(cc, job.image_base);
+        }
+        cc->sort();
+        addGoRuntimeStopRanges(cc);
+
+        // Save whatever the cache was missing. A table built later by the
+        // UnwindWorker isn't saved, but one built in eager mode is.
+        bool have_table = cc->unwindTable() != NULL;
+        if (build_id != NULL && ((load_symbols && !(cached & PersistentCache::CACHED_SYMBOLS)) ||
+                                 (have_table && !(cached & PersistentCache::CACHED_UNWIND_TABLE)))) {
+            PersistentCache::store(cc, job.image_base, build_id, build_id_len);
+        }
+    }
+    return NULL;
+}
+
+int Symbols::parseThreads() {
+    if (_parse_threads > 0) {
+        return _parse_threads;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < MAX_PARSE_THREADS ? (int)cpus : MAX_PARSE_THREADS;
+}
+
+// Parses the libraries, each into its own CodeCache, on up to parseThreads()
+// threads including the calling one. The workers take libraries in order
+// from a shared counter, so a large library doesn't hold up the others.
+static void parseLibraryJobsInParallel(std::vector<LibraryJob>& jobs) {
+    LibraryJobs shared = {&jobs, 0};
+
+    int threads = Symbols::parseThreads();
+    if ((size_t)threads > jobs.size()) {
+        threads = (int)jobs.size();
+    }
+
+    // The workers shouldn't handle any signals, in particular SIGPROF, so
+    // block them all while the threads are created so they inherit the mask
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    std::vector<pthread_t> workers;
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, parseLibraryJobs, &shared) != 0) {
+            break;
+        }
+        workers.push_back(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    parseLibraryJobs(&shared);
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// The loader's counts of loaded and unloaded objects when librariesChanged
+// was last called
+static unsigned long long last_adds = 0;
+static unsigned long long last_subs = 0;
+
+struct LoadCounts {
+    unsigned long long adds;
+    unsigned long long subs;
+};
+
+static int readLoadCounts(struct dl_phdr_info* info, size_t size, void* data) {
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        return 0;  // the counters aren't provided
+    }
+    LoadCounts* counts = (LoadCounts*)data;
+    counts->adds = info->dlpi_adds;
+    counts->subs = info->dlpi_subs;
+    return 1;  // the counters are the same for every object
+}
+
+bool Symbols::librariesChanged() {
+    LoadCounts counts;
+    if (dl_iterate_phdr(readLoadCounts, &counts) != 1) {
+        return false;
+    }
+    bool changed = counts.adds != last_adds || counts.subs != last_subs;
+    last_adds = counts.adds;
+    last_subs = counts.subs;
+    return changed;
+}
+
+// The library parseDwarfTableIfLoaded looks for among the loaded objects
+struct LoadedTable {
+    CodeCache* cc;
+    int objects;
+    bool found;
+};
+
+static int parseTableIfLoaded(struct dl_phdr_info* info, size_t /*size*/, void* data) {
+    LoadedTable* table = (LoadedTable*)data;
+    table->objects++;
+
+    const ElfProgramHeader* phdr = (const ElfProgramHeader*)info->dlpi_phdr;
+    const char* header = NULL;
+    const char* eh_frame_hdr = NULL;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_offset == 0 && header == NULL) {
+            header = (const char*)(info->dlpi_addr + phdr[i].p_vaddr);
+        } else if (phdr[i].p_type == PT_GNU_EH_FRAME) {
+            eh_frame_hdr = (const char*)(info->dlpi_addr + phdr[i].p_vaddr);
+        }
+    }
+    if (header != table->cc->getTextBase() || eh_frame_hdr != table->cc->ehFrameHdr()) {
+        return 0;
+    }
+
+    // dlclose unlinks an object under the same lock the loader holds while
+    // calling back, before unmapping it
+    table->cc->parseDwarfTable();
+    table->found = true;
+    return 1;
+}
+
+bool Symbols::parseDwarfTableIfLoaded(CodeCache* cc) {
+    LoadedTable table = {cc, 0, false};
+    dl_iterate_phdr(parseTableIfLoaded, &table);
+    if (table.objects == 0) {
+        // The libraries came from /proc/self/maps, as there is no loader to
+        // list them, nor to unload them
+        cc->parseDwarfTable();
+        return true;
+    }
+    return table.found;
+}
+
+// Where parseLibraries collects the libraries it finds
+struct LibraryScan {
+    CodeCacheArray* array;
+    std::vector<LibraryJob> jobs;
+    std::set<CodeCache*> kept;
+    int objects;
+};
+
+// Library indexes are only labels, so after INT_MAX libraries they start
+// over rather than overflowing
+static int next_lib_index = 0;
+
+static int nextLibIndex() {
+    int index = next_lib_index;
+    next_lib_index = index == INT_MAX ? 0 : index + 1;
+    return index;
+}
+
+// Adds the executable segment [start, end) of a library to the scan, unless
+// the array already has it
+// eh_frame_hdr is where the object's .eh_frame_hdr is loaded, if known, to
+// tell a library apart from another build of it loaded at the same address
+static void addLibrary(LibraryScan* scan, const char* file, const char* start, const char* end,
+                       const char* eh_frame_hdr, LibraryJob job) {
+    CodeCache* cc = scan->array->find(start);
+    if (cc != NULL && cc->minAddress() == start && strcmp(cc->name(), file) == 0 &&
+        (eh_frame_hdr == NULL || cc->ehFrameHdr() == NULL || cc->ehFrameHdr() == eh_frame_hdr)) {
+        scan->kept.insert(cc);
+        return;
+    }
+    job.cc = new CodeCache(file, nextLibIndex(), start, end);
+    scan->jobs.push_back(job);
+}
+
+static char exe_path[PATH_MAX];
+static pthread_once_t exe_path_once = PTHREAD_ONCE_INIT;
+
+static void initExePath() {
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len > 0) {
+        exe_path[len] = 0;
+        return;
+    }
+    // Without /proc, use the path the executable was started with
+    const char* execfn = (const char*)getauxval(AT_EXECFN);
+    if (execfn != NULL) {
+        strncpy(exe_path, execfn, sizeof(exe_path) - 1);
+    }
+}
+
+// The loader reports the main executable without a name
+static const char* exePath() {
+    pthread_once(&exe_path_once, initExePath);
+    return exe_path;
+}
+
+// Finds the file mapped at address in /proc/self/maps, and copies its path to
+// path. Returns false if it isn't found.
+static bool findMappedFile(const char* address, char* path, size_t size) {
+    FILE* f = fopen("/proc/self/maps", "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    char* str = NULL;
+    size_t str_size = 0;
+    ssize_t len;
+    while (!found && (len = getline(&str, &str_size, f)) > 0) {
+        str[len - 1] = 0;
+        MemoryMapDesc map(str);
+        if (address >= map.addr() && address < map.end() && map.file() != NULL && map.file()[0] == '/') {
+            strncpy(path, map.file(), size - 1);
+            path[size - 1] = 0;
+            found = true;
+        }
+    }
+
+    free(str);
+    fclose(f);
+    return found;
+}
+
+// The loader reports a library by the name it was opened with, which is
+// relative to the working directory at the time if it had a slash but didn't
+// start with one. The working directory may have changed since, so the path
+// comes from the file mapped at header, or failing that, from realpath.
+// Returns file, or path if it was resolved.
+static const char* resolveLibraryPath(const char* file, const char* header, char* path) {
+    if (file[0] == '/' || file[0] == '[') {
+        return file;
+    }
+    if (header != NULL && findMappedFile(header, path, PATH_MAX)) {
+        return path;
+    }
+    if (realpath(file, path) != NULL) {
+        return path;
+    }
+    return file;
+}
+
+static int addLoadedObject(struct dl_phdr_info* info, size_t /*size*/, void* data) {
+    LibraryScan* scan = (LibraryScan*)data;
+    scan->objects++;
+
+    const uintptr_t page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    const ElfProgramHeader* phdr = (const ElfProgramHeader*)info->dlpi_phdr;
+
+    // The ELF header is mapped by the segment at file offset zero
+    const char* header = NULL;
+    const char* eh_frame_hdr = NULL;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_offset == 0 && (phdr[i].p_flags & PF_R) && header == NULL) {
+            header = (const char*)(info->dlpi_addr + phdr[i].p_vaddr);
+        } else if (phdr[i].p_type == PT_GNU_EH_FRAME) {
+            eh_frame_hdr = (const char*)(info->dlpi_addr + phdr[i].p_vaddr);
+        }
+    }
+
+    bool vdso = header != NULL && (uintptr_t)header == getauxval(AT_SYSINFO_EHDR);
+    const char* file = info->dlpi_name;
+    char path[PATH_MAX];
+    if (vdso) {
+        file = "[vdso]";
+    } else if (file == NULL || file[0] == 0) {
+        file = exePath();
+        if (file[0] == 0) {
+            return 0;
+        }
+    } else {
+        file = resolveLibraryPath(file, header, path);
+    }
+
+    bool first = true;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD || !(phdr[i].p_flags & PF_X)) {
+            continue;
+        }
+        // Page align the segment to match its mapping
+        uintptr_t vaddr = info->dlpi_addr + phdr[i].p_vaddr;
+        const char* start = (const char*)(vaddr & page_mask);
+        const char* end = (const char*)((vaddr + phdr[i].p_memsz + ~page_mask) & page_mask);
+
+        LibraryJob job = {NULL, start - (phdr[i].p_offset & page_mask), false, false, false};
+        if (vdso) {
+            job.parse_mem = true;
+        } else if (first) {
+            // Only the first executable segment has the symbols from the
+            // file, as each segment has its own CodeCache
+            job.parse_program_headers = header != NULL && header == job.image_base;
+            job.parse_file = true;
+        }
+        first = false;
+        addLibrary(scan, file, start, end, eh_frame_hdr, job);
+    }
+    return 0;
+}
+
+// Finds the libraries in /proc/self/maps, for when the loader can't list
+// them. Returns false if the file can't be read.
+static bool scanMemoryMap(LibraryScan* scan) {
     // we can't use static global sets due to undefined initialization order stuff
     // (see https://stackoverflow.com/questions/27145617/segfault-when-adding-an-element-to-a-stdmap)
     // I'm not sure why this original code even worked?
@@ -493,7 +1002,7 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
 
     FILE* f = fopen("/proc/self/maps", "r");
     if (f == NULL) {
-        return;
+        return false;
     }
 
     const char* last_readable_base = NULL;
@@ -519,34 +1028,67 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
                 continue;  // the library was already parsed
             }
 
-            int count = array->count();
-            if (count >= MAX_NATIVE_LIBS) {
-                break;
-            }
-
-            CodeCache* cc = new CodeCache(map.file(), count, image_base, image_end);
-
+            LibraryJob job = {NULL, image_base, false, false, false};
             unsigned long inode = map.inode();
             if (inode != 0) {
                 // Do not parse the same executable twice, e.g. on Alpine Linux
                 if (parsed_inodes.insert(map.dev() | inode << 16).second) {
                     // Be careful: executable file is not always ELF, e.g. classes.jsa
-                    if ((image_base -= map.offs()) >= last_readable_base) {
-                        ElfParser::parseProgramHeaders(cc, image_base);
-                    }
-                    ElfParser::parseFile(cc, image_base, map.file(), true);
+                    job.image_base = image_base - map.offs();
+                    job.parse_program_headers = job.image_base >= last_readable_base;
+                    job.parse_file = true;
                 }
             } else if (strcmp(map.file(), "[vdso]") == 0) {
-                ElfParser::parseMem(cc, image_base);
+                job.parse_mem = true;
             }
 
-            cc->sort();
-            array->add(cc);
+            addLibrary(scan, map.file(), image_base, image_end, NULL, job);
         }
     }
 
     free(str);
     fclose(f);
+    return true;
+}
+
+void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
+    LibraryScan scan;
+    scan.array = array;
+    scan.objects = 0;
+
+    // Libraries which are still loaded are kept as they are, so only the
+    // ones loaded since the last call are parsed
+    array->lock();
+    int existing = array->count();
+
+    // The loader lists its objects with their program headers, which is
+    // much cheaper than reading the memory map of a process with many
+    // mappings, and doesn't need /proc
+    dl_iterate_phdr(addLoadedObject, &scan);
+    if (scan.objects == 0 && !scanMemoryMap(&scan)) {
+        array->unlock();
+        return;
+    }
+
+    parseLibraryJobsInParallel(scan.jobs);
+
+    // Add in the order the libraries were found, regardless of which worker
+    // finished first, so that library indices are deterministic
+    std::vector<CodeCache*> added;
+    for (size_t i = 0; i < scan.jobs.size(); i++) {
+        added.push_back(scan.jobs[i].cc);
+    }
+    std::vector<CodeCache*> removed;
+    for (int i = 0; i < existing; i++) {
+        if (scan.kept.find((*array)[i]) == scan.kept.end()) {
+            removed.push_back((*array)[i]);
+        }
+    }
+
+    if (!added.empty() || !removed.empty()) {
+        array->update(added.data(), (int)added.size(), removed.data(), (int)removed.size());
+    }
+    array->unlock();
 }
 
 #endif // __linux__
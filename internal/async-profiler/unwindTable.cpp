@@ -0,0 +1,194 @@
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#include "unwindTable.h"
+
+struct UnwindRow {
+    u32 loc;
+    u32 kind;
+};
+
+static bool sortedByLoc(const FrameDesc* table, int count) {
+    for (int i = 1; i < count; i++) {
+        if (table[i].loc < table[i - 1].loc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int compareLoc(const void* p1, const void* p2) {
+    u32 loc1 = ((const FrameDesc*)p1)->loc;
+    u32 loc2 = ((const FrameDesc*)p2)->loc;
+    return loc1 < loc2 ? -1 : loc1 > loc2 ? 1 : 0;
+}
+
+static void addRow(std::vector<UnwindRow>& rows, u32 loc, u32 kind) {
+    if (!rows.empty() && rows.back().loc == loc) {
+        // A later row at the same location replaces the earlier one
+        rows.pop_back();
+    }
+    if (!rows.empty() && rows.back().kind == kind) {
+        return;
+    }
+    UnwindRow row = {loc, kind};
+    rows.push_back(row);
+}
+
+UnwindTable* UnwindTable::build(const FrameDesc* table, int count) {
+    if (count <= 0) {
+        return NULL;
+    }
+
+    FrameDesc* sorted = NULL;
+    if (!sortedByLoc(table, count)) {
+        sorted = (FrameDesc*)malloc(count * sizeof(FrameDesc));
+        if (sorted == NULL) {
+            return NULL;
+        }
+        memcpy(sorted, table, count * sizeof(FrameDesc));
+        qsort(sorted, count, sizeof(FrameDesc), compareLoc);
+        table = sorted;
+    }
+
+    // Kind 0 is reserved for "no frame description"
+    std::vector<FrameDesc> kinds(1, FrameDesc::default_frame);
+    std::map<std::pair<int, int>, u32> kind_index;
+    std::vector<UnwindRow> rows;
+    rows.reserve(count);
+
+    for (int i = 0; i < count; i++) {
+        const FrameDesc& f = table[i];
+        std::pair<int, int> key(f.cfa, f.fp_off);
+        std::map<std::pair<int, int>, u32>::iterator it = kind_index.find(key);
+        u32 kind;
+        if (it != kind_index.end()) {
+            kind = it->second;
+        } else if (kinds.size() < MAX_KINDS) {
+            kind = kinds.size();
+            FrameDesc k = {0, 0xffffffff, f.cfa, f.fp_off};
+            kinds.push_back(k);
+            kind_index[key] = kind;
+        } else {
+            // Not expected in practice. Fall back to frame pointers.
+            kind = 0;
+        }
+        addRow(rows, f.loc, kind);
+
+        // The row applies through loc_end, so if there is a gap before the
+        // next row then mark it as having no frame description
+        if (f.loc_end != 0xffffffff && (i + 1 == count || f.loc_end + 1 < table[i + 1].loc)) {
+            addRow(rows, f.loc_end + 1, 0);
+        }
+    }
+    free(sorted);
+
+    u32 base_loc = rows.front().loc & ~PAGE_MASK;
+    u32 page_count = ((rows.back().loc - base_loc) >> PAGE_SHIFT) + 1;
+    size_t size = sizeof(UnwindTable) + kinds.size() * sizeof(FrameDesc) +
+                  (page_count + 1 + rows.size()) * sizeof(u32);
+
+    UnwindTable* t = (UnwindTable*)malloc(size);
+    if (t == NULL) {
+        return NULL;
+    }
+    t->_base_loc = base_loc;
+    t->_page_count = page_count;
+    t->_record_count = rows.size();
+    t->_kind_count = kinds.size();
+
+    memcpy((FrameDesc*)t->kinds(), &kinds[0], kinds.size() * sizeof(FrameDesc));
+
+    u32* pages = (u32*)t->pages();
+    u32* records = (u32*)t->records();
+    u32 page = 0;
+    for (u32 i = 0; i < rows.size(); i++) {
+        u32 rel = rows[i].loc - base_loc;
+        while (page <= (rel >> PAGE_SHIFT)) {
+            pages[page++] = i;
+        }
+        records[i] = (rel & PAGE_MASK) | rows[i].kind << PAGE_SHIFT;
+    }
+    while (page <= page_count) {
+        pages[page++] = rows.size();
+    }
+
+    return t;
+}
+
+void UnwindTable::destroy(UnwindTable* table) {
+    free(table);
+}
+
+bool UnwindTable::valid(size_t bytes) const {
+    if (bytes < sizeof(UnwindTable) || size() != bytes || _record_count > 0x7fffffff) {
+        return false;
+    }
+    const u32* pages = this->pages();
+    u32 prev = 0;
+    for (u32 i = 0; i <= _page_count; i++) {
+        if (pages[i] < prev || pages[i] > _record_count) {
+            return false;
+        }
+        prev = pages[i];
+    }
+    const u32* records = this->records();
+    for (u32 i = 0; i < _record_count; i++) {
+        if ((records[i] >> PAGE_SHIFT) >= _kind_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FrameDesc* UnwindTable::find(u32 loc, u32* start, u32* end) const {
+    if (loc < _base_loc) {
+        return NULL;
+    }
+
+    u32 rel = loc - _base_loc;
+    u32 page = rel >> PAGE_SHIFT;
+    u32 page_start = _base_loc + (page << PAGE_SHIFT);
+    int r;
+    if (page >= _page_count) {
+        // Past the last row, which usually has no frame description
+        r = _record_count - 1;
+        *start = _base_loc + (_page_count << PAGE_SHIFT);
+        *end = 0xffffffff;
+    } else {
+        const u32* records = this->records();
+        u32 offset = rel & PAGE_MASK;
+        int first = pages()[page];
+        int low = first;
+        int high = (int)pages()[page + 1] - 1;
+        int limit = high + 1;
+
+        // Find the last row of the page starting at or before the offset
+        while (low <= high) {
+            int mid = (unsigned int)(low + high) >> 1;
+            if ((records[mid] & PAGE_MASK) <= offset) {
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+        r = low - 1;
+
+        // If the row starts on an earlier page, only claim this page. Likewise
+        // for the end if the next row is on a later page.
+        *start = r >= first ? page_start + (records[r] & PAGE_MASK) : page_start;
+        *end = low < limit ? page_start + (records[low] & PAGE_MASK) : page_start + PAGE_MASK + 1;
+    }
+
+    if (r < 0) {
+        return NULL;
+    }
+    u32 kind = records()[r] >> PAGE_SHIFT;
+    if (kind == 0) {
+        return NULL;
+    }
+    return (FrameDesc*)&kinds()[kind];
+}
@@ -0,0 +1,76 @@
+#ifndef _UNWINDTABLE_H
+#define _UNWINDTABLE_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "dwarf.h"
+
+
+// UnwindTable is a compact, read-only encoding of a library's FrameDesc table.
+//
+// Most libraries only use a few hundred distinct (cfa, fp_off) rules, so each
+// distinct rule is stored once as a "kind" and every row of the table becomes
+// a single 32-bit record: the row's offset within a small page of code, plus
+// the index of its kind. A first-level index gives the first record of every
+// page, so a lookup reads one page index entry and binary searches the records
+// of a single page, which usually fit in a cache line or two.
+//
+// A row applies until the next row starts. Address ranges without a frame
+// description are covered by rows of kind 0, for which find returns NULL.
+//
+// The table is one contiguous, position independent block of memory:
+//
+//     UnwindTable header
+//     FrameDesc   kinds[kind_count]
+//     u32         pages[page_count + 1]
+//     u32         records[record_count]
+class UnwindTable {
+  private:
+    u32 _base_loc;
+    u32 _page_count;
+    u32 _record_count;
+    u32 _kind_count;
+
+    const FrameDesc* kinds() const {
+        return (const FrameDesc*)(this + 1);
+    }
+
+    const u32* pages() const {
+        return (const u32*)(kinds() + _kind_count);
+    }
+
+    const u32* records() const {
+        return pages() + _page_count + 1;
+    }
+
+  public:
+    static const int PAGE_SHIFT = 10;
+    static const u32 PAGE_MASK = (1 << PAGE_SHIFT) - 1;
+    static const u32 MAX_KINDS = 1 << (32 - PAGE_SHIFT);
+
+    // Builds a table from FrameDesc rows as produced by DwarfParser. Returns
+    // NULL if there are no rows or memory can't be allocated.
+    static UnwindTable* build(const FrameDesc* table, int count);
+    static void destroy(UnwindTable* table);
+
+    // Size of the table in bytes
+    size_t size() const {
+        return sizeof(UnwindTable) + _kind_count * sizeof(FrameDesc) +
+               (_page_count + 1 + _record_count) * sizeof(u32);
+    }
+
+    // Checks that a table read from elsewhere, such as a cache file, is
+    // bytes long and consistent enough for find to stay within it
+    bool valid(size_t bytes) const;
+
+    int recordCount() const {
+        return _record_count;
+    }
+
+    // Returns the frame description for the given location relative to the
+    // text base, and a range [start, end) of locations it also applies to.
+    // Only the cfa and fp_off fields of the result are meaningful.
+    FrameDesc* find(u32 loc, u32* start, u32* end) const;
+};
+
+#endif // _UNWINDTABLE_H
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <signal.h>
+
+#include "stackSnapshot.h"
+#include "symbols.h"
+#include "unwindWorker.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+
+// How often the worker checks for loaded and unloaded libraries when nothing
+// asks it to
+static const long REFRESH_INTERVAL_MS = 1000;
+
+// The least time between checks asked for by requestRefresh. Addresses
+// outside every library are common at the end of walks, so without a limit
+// they'd have the worker rescan the libraries at the sample rate.
+static const long MIN_REFRESH_GAP_MS = 100;
+
+static sem_t wakeup;
+static bool started = false;
+static int refresh_requested = 0;
+// When the libraries were last checked, in CLOCK_MONOTONIC milliseconds
+static long last_refresh_ms = 0;
+
+static long monotonicMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void buildRequestedTables(CodeCacheArray* array) {
+    // The lock keeps the libraries from being removed from the array
+    // meanwhile, but not from being unloaded, which the tables are only
+    // built under the loader's lock for
+    bool unloaded = false;
+    array->lock();
+    int count = array->count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* cc = (*array)[i];
+        if (cc->dwarfTableRequested() && !Symbols::parseDwarfTableIfLoaded(cc)) {
+            unloaded = true;
+        }
+    }
+    array->unlock();
+
+    // Drop the unloaded libraries rather than finding them again next time
+    if (unloaded) {
+        Symbols::parseLibraries(array, false);
+    }
+}
+
+static void* run(void* arg) {
+    CodeCacheArray* array = (CodeCacheArray*)arg;
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REFRESH_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (REFRESH_INTERVAL_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (sem_timedwait(&wakeup, &deadline) != 0 && errno != ETIMEDOUT) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+
+        // The worker is also woken for other work, such as snapshots to
+        // unwind, which shouldn't check the libraries every time
+        long now = monotonicMillis();
+        bool requested = __atomic_exchange_n(&refresh_requested, 0, __ATOMIC_RELAXED) != 0;
+        if (requested || now - __atomic_load_n(&last_refresh_ms, __ATOMIC_RELAXED) >= REFRESH_INTERVAL_MS) {
+            __atomic_store_n(&last_refresh_ms, now, __ATOMIC_RELAXED);
+            if (Symbols::librariesChanged()) {
+                Symbols::parseLibraries(array, false);
+            }
+        }
+        buildRequestedTables(array);
+        // Unwinding reads the snapshots through the same per-thread state
+        // as a walk of this thread's own stack, which is safe since this
+        // thread never handles profiling signals
+        StackSnapshots::unwindPending(array);
+    }
+}
+
+namespace UnwindWorker {
+
+bool start(CodeCacheArray* array) {
+    if (started) {
+        return true;
+    }
+    if (sem_init(&wakeup, 0, 0) != 0) {
+        return false;
+    }
+
+    // The worker shouldn't handle any signals, in particular SIGPROF, so
+    // block them all while the thread is created so it inherits the mask
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    started = pthread_create(&thread, &attr, run, array) == 0;
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return started;
+}
+
+void wake() {
+    if (started) {
+        sem_post(&wakeup);
+    }
+}
+
+void requestRefresh() {
+    if (!started || monotonicMillis() - __atomic_load_n(&last_refresh_ms, __ATOMIC_RELAXED) < MIN_REFRESH_GAP_MS) {
+        return;
+    }
+    // Only the first request until the worker gets to it posts, so that a
+    // burst of misses doesn't keep the worker spinning
+    if (__atomic_exchange_n(&refresh_requested, 1, __ATOMIC_RELAXED) == 0) {
+        sem_post(&wakeup);
+    }
+}
+
+}
+
+#else
+
+namespace UnwindWorker {
+
+bool start(CodeCacheArray* array) {
+    return false;
+}
+
+void wake() {
+}
+
+void requestRefresh() {
+}
+
+}
+
+#endif // __linux__
@@ -0,0 +1,29 @@
+#ifndef _UNWINDWORKER_H
+#define _UNWINDWORKER_H
+
+#include "codeCache.h"
+
+// UnwindWorker is a background thread which does the unwinder work that isn't
+// safe to do from a signal handler, such as building a library's unwind table
+// the first time it's needed, and keeping the libraries up to date as they
+// are loaded and unloaded. It also unwinds the stack snapshots taken by
+// profiling signals, if they're enabled.
+namespace UnwindWorker {
+
+// Starts the worker for the given libraries. Returns false if the thread
+// couldn't be started, or the platform isn't supported.
+bool start(CodeCacheArray* array);
+
+// Wakes up the worker to look for libraries with requested unwind tables,
+// and stack snapshots to unwind. Safe to call from a signal handler.
+void wake();
+
+// Asks the worker to check for loaded or unloaded libraries, e.g. after an
+// address wasn't found in any library. Ignored within 100ms of the last
+// check. The worker also checks every second. Safe to call from a signal
+// handler.
+void requestRefresh();
+
+}
+
+#endif // _UNWINDWORKER_H
@@ -0,0 +1,17 @@
+//go:build cgotraceback_bench
+// +build cgotraceback_bench
+
+package asyncprofiler
+
+import "testing"
+
+func TestUnwindTableMatchesFrameDesc(t *testing.T) {
+	tables := newBenchUnwindTables()
+	defer tables.close()
+	if tables.flatBytes == 0 {
+		t.Skip("no unwind tables loaded")
+	}
+	if n := tables.check(); n != 0 {
+		t.Errorf("compact table or decoded FDEs disagree with FrameDesc table at %d locations", n)
+	}
+}
@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <unwind.h>
+
+#include "unwinder.h"
+
+void populateStackContext(StackContext &sc, void *ucontext);
+
+static UnwindEngine current_engine = UNWIND_DWARF;
+
+// State of a walk with _Unwind_Backtrace, which starts at the frame calling
+// it, so frames are skipped until the one the walk should start from
+struct GccWalk {
+    const void* start;
+    bool started;
+    uintptr_t* callchain;
+    int max_depth;
+    int depth;
+};
+
+static _Unwind_Reason_Code gccFrame(struct _Unwind_Context* context, void* arg) {
+    GccWalk* w = (GccWalk*)arg;
+    const void* pc = (const void*)_Unwind_GetIP(context);
+    if (!w->started) {
+        if (pc != w->start) {
+            return _URC_NO_REASON;
+        }
+        w->started = true;
+    }
+    w->callchain[w->depth++] = (uintptr_t)pc;
+    if (w->depth >= w->max_depth || inStopRange(pc)) {
+        return _URC_END_OF_STACK;
+    }
+    return _URC_NO_REASON;
+}
+
+static int walkGcc(const StackContext &sc, uintptr_t* callchain, int max_depth) {
+    GccWalk w = {sc.pc, false, callchain, max_depth, 0};
+    _Unwind_Backtrace(gccFrame, &w);
+    return w.depth;
+}
+
+namespace Unwinder {
+
+bool supported(UnwindEngine engine) {
+    switch (engine) {
+        case UNWIND_DWARF:
+        case UNWIND_FP:
+        case UNWIND_GCC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+UnwindEngine engine() {
+    return __atomic_load_n(&current_engine, __ATOMIC_RELAXED);
+}
+
+bool setEngine(UnwindEngine engine) {
+    if (!supported(engine)) {
+        return false;
+    }
+    __atomic_store_n(&current_engine, engine, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool walksSavedFrames(UnwindEngine engine) {
+    switch (engine) {
+        case UNWIND_GCC:
+            return false;
+        default:
+            return true;
+    }
+}
+
+bool recordsSlots(UnwindEngine engine) {
+    return engine == UNWIND_DWARF || engine == UNWIND_FP;
+}
+
+int walk(UnwindEngine engine, CodeCacheArray* cache, StackContext &sc, bool live,
+         uintptr_t* callchain, int max_depth, void*** slots, int max_slots) {
+    if (!live && !walksSavedFrames(engine)) {
+        // Frame pointers are the closest thing that works here
+        engine = UNWIND_FP;
+    }
+    switch (engine) {
+        case UNWIND_FP:
+            return stackWalkFP(sc, callchain, max_depth, slots, max_slots);
+        case UNWIND_GCC:
+            return walkGcc(sc, callchain, max_depth);
+        default:
+            return stackWalk(cache, sc, callchain, max_depth, 0, slots, max_slots);
+    }
+}
+
+int walkSignal(UnwindEngine engine, CodeCacheArray* cache, void* ucontext, uintptr_t* callchain, int max_depth) {
+    StackContext sc;
+    switch (engine) {
+        case UNWIND_FP:
+        case UNWIND_GCC:
+            // _Unwind_Backtrace can't start from the interrupted frame
+            populateStackContext(sc, ucontext);
+            return stackWalkFP(sc, callchain, max_depth);
+        default:
+            // Samples of a thread tend to share most of their call stack,
+            // so the last walk on the thread is reused where possible
+            populateStackContext(sc, ucontext);
+            return stackWalkMemo(cache, sc, callchain, max_depth);
+    }
+}
+
+}
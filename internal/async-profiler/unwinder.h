@@ -0,0 +1,58 @@
+#ifndef _UNWINDER_H
+#define _UNWINDER_H
+
+#include <stdint.h>
+
+#include "codeCache.h"
+#include "stackWalker.h"
+
+// The ways a call stack can be unwound, in the same order as the Go constants
+enum UnwindEngine {
+    // The DWARF and frame pointer hybrid in stackWalker.cpp, using the unwind
+    // tables parsed from every library
+    UNWIND_DWARF,
+    // Frame pointers only. Cheap, but loses the caller of every frame built
+    // without a frame pointer
+    UNWIND_FP,
+    // libgcc's _Unwind_Backtrace. It can only unwind from the frame calling
+    // it, and isn't signal safe, so contexts are unwound when they're saved
+    // rather than when they're used, and profiling signals fall back to
+    // frame pointers
+    UNWIND_GCC,
+    UNWIND_ENGINES
+};
+
+// Unwinder runs the selected unwind engine. Every engine stops at the stop
+// ranges, like stackWalk.
+namespace Unwinder {
+
+// Returns whether the engine was built in and works on this platform
+bool supported(UnwindEngine engine);
+
+UnwindEngine engine();
+
+// Selects the engine used from now on. Returns false, leaving the engine as
+// it was, if it isn't supported.
+bool setEngine(UnwindEngine engine);
+
+// Returns whether the engine can unwind from the saved registers of a frame
+// which is still on the stack, rather than only from its caller
+bool walksSavedFrames(UnwindEngine engine);
+
+// Returns whether the engine records where return addresses were read, as
+// described for stackWalk
+bool recordsSlots(UnwindEngine engine);
+
+// Walks the call stack from sc, the registers of a frame still on the stack.
+// If live is true, the frame is a caller of this call, which lets engines
+// which can't walk from saved registers do so. Slots are recorded as for
+// stackWalk if the engine records them. Not signal safe for every engine.
+int walk(UnwindEngine engine, CodeCacheArray* cache, StackContext &sc, bool live,
+         uintptr_t* callchain, int max_depth, void*** slots = NULL, int max_slots = 0);
+
+// Walks the call stack interrupted by a signal. Signal safe.
+int walkSignal(UnwindEngine engine, CodeCacheArray* cache, void* ucontext, uintptr_t* callchain, int max_depth);
+
+}
+
+#endif // _UNWINDER_H
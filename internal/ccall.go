@@ -18,12 +18,33 @@ void doGoCallbackRecursive(int depth) {
 	goCallback();
 }
 
+__attribute__ ((noinline)) void doGoCallbackDepth(int depth) {
+	doGoCallbackRecursive(depth);
+}
+
+__attribute__ ((noinline)) unsigned long spinC(int depth, unsigned long n) {
+	if (depth > 0) {
+		return spinC(depth - 1, n) + 1;
+	}
+	volatile unsigned long x = 0;
+	for (unsigned long i = 0; i < n; i++) {
+		x += i;
+	}
+	return x;
+}
+
+static void *spinCAddress(void) {
+	return (void *) spinC;
+}
+
 __attribute__ ((noinline)) void doGoCallback2(void) {
 	goCallback2();
 }
 */
 import "C"
 
+import "runtime"
+
 var (
 	CFuncName  = "goCallback"
 	CFuncName2 = "goCallback2"
@@ -36,7 +57,41 @@ func DoCallback(f func()) {
 	C.doGoCallback()
 }
 
+// DoCallbackDepth calls f from C, under depth+1 levels of C recursion
+func DoCallbackDepth(depth int, f func()) {
+	callback = f
+	C.doGoCallbackDepth(C.int(depth))
+}
+
+// SpinC busy loops n times in C, under depth+1 levels of C recursion
+func SpinC(depth, n int) {
+	C.spinC(C.int(depth), C.ulong(n))
+}
+
+// SpinCAddress returns the address of the C function SpinC recurses through
+// and loops in
+func SpinCAddress() uintptr {
+	return uintptr(C.spinCAddress())
+}
+
 func DoCallback2(f func()) {
 	callback = f
 	C.doGoCallback2()
 }
+
+// HasCFrame reports whether the caller's call stack includes the C side of
+// DoCallback, which it only does if the call's context was captured
+func HasCFrame() bool {
+	var pcs [64]uintptr
+	n := runtime.Callers(0, pcs[:])
+	frames := runtime.CallersFrames(pcs[:n])
+	for {
+		frame, more := frames.Next()
+		if frame.Function == CFuncName {
+			return true
+		}
+		if !more {
+			return false
+		}
+	}
+}
@@ -0,0 +1,116 @@
+//go:build cgo && linux
+// +build cgo,linux
+
+package cgotraceback_test
+
+import (
+	"io"
+	"runtime"
+	"runtime/pprof"
+	"syscall"
+	"testing"
+	"time"
+
+	"github.com/nsrip-dd/cgotraceback"
+	"github.com/nsrip-dd/cgotraceback/internal"
+)
+
+// inSpinC reports whether a snapshot was taken in internal.SpinC, which is
+// small, rather than in other C code, such as the reads of the snapshots
+func inSpinC(pcs []uintptr) bool {
+	spin := internal.SpinCAddress()
+	return len(pcs) > 0 && pcs[0] >= spin && pcs[0] < spin+1024
+}
+
+// checkSpinSnapshot returns why the call stack of a snapshot taken in
+// internal.SpinC isn't what it should be, or "" if it is, and whether the
+// sample was taken under all depth recursive calls, rather than while they
+// were being made or returning
+func checkSpinSnapshot(pcs []uintptr, depth int) (string, bool) {
+	// The C call stack ends where Go called into C
+	f := runtime.FuncForPC(pcs[len(pcs)-1])
+	if f == nil || f.Name() != "runtime.asmcgocall" {
+		return "doesn't end at runtime.asmcgocall", false
+	}
+	if len(pcs) == 2 {
+		// Taken in cgo's wrapper, which follows SpinC
+		return "", false
+	}
+	// Each recursive call returns to the same place
+	recursive := pcs[1 : len(pcs)-2]
+	for _, pc := range recursive {
+		if pc != recursive[0] {
+			return "recursive frames missing", false
+		}
+	}
+	if len(recursive) > depth {
+		return "too many recursive frames", false
+	}
+	return "", len(recursive) == depth
+}
+
+func TestStackSnapshots(t *testing.T) {
+	if !cgotraceback.EnableStackSnapshots(0) {
+		t.Skip("stack snapshots not supported")
+	}
+	defer cgotraceback.DisableStackSnapshots()
+	// Drop snapshots left by anything else
+	cgotraceback.ReadStackSnapshots(func(cgotraceback.StackSnapshot) {})
+
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	tid := syscall.Gettid()
+
+	const depth = 12
+	var snapshots, full int
+	var problems []string
+	read := func(start, end time.Time) {
+		cgotraceback.ReadStackSnapshots(func(s cgotraceback.StackSnapshot) {
+			if !inSpinC(s.PCs) {
+				return
+			}
+			snapshots++
+			problem, deepest := checkSpinSnapshot(s.PCs, depth)
+			if s.TID != tid {
+				problem = "not taken on the thread running SpinC"
+			} else if s.Time.Before(start) || s.Time.After(end) {
+				problem = "taken outside the profile"
+			}
+			if problem == "" && deepest {
+				full++
+			}
+			if problem != "" && len(problems) < 5 {
+				problems = append(problems, problem)
+				t.Logf("%s: %x", problem, s.PCs)
+			}
+		})
+	}
+
+	if err := pprof.StartCPUProfile(io.Discard); err != nil {
+		t.Skipf("CPU profile already running: %v", err)
+	}
+	start := time.Now()
+	// Each CPU only holds a few snapshots until they're read
+	for time.Since(start) < time.Second {
+		internal.SpinC(depth, 1<<20)
+		read(start, time.Now())
+	}
+	pprof.StopCPUProfile()
+	// The last few may still be waiting to be unwound
+	end := time.Now()
+	for wait := time.Now(); time.Since(wait) < 100*time.Millisecond; time.Sleep(10 * time.Millisecond) {
+		read(start, end)
+	}
+
+	t.Logf("%d snapshots, %d at full depth", snapshots, full)
+	if snapshots == 0 {
+		t.Fatal("no snapshots taken in SpinC")
+	}
+	if len(problems) > 0 {
+		t.Errorf("snapshots had the wrong call stack: %v", problems)
+	}
+	// SpinC spends almost all its time in the loop at the bottom
+	if full < snapshots*9/10 {
+		t.Errorf("only %d of %d snapshots were taken at full depth", full, snapshots)
+	}
+}
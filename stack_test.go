@@ -0,0 +1,57 @@
+//go:build cgo && linux
+// +build cgo,linux
+
+package cgotraceback
+
+import (
+	"io"
+	"runtime"
+	"runtime/pprof"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/nsrip-dd/cgotraceback/internal"
+)
+
+// Go->C calls run on threads the Go runtime created, which may never call
+// back into Go, so their stack bounds must be cached when they're created
+// for profiling signals in C to read the stack with plain loads
+func TestGoToCStackBounds(t *testing.T) {
+	fallback, faults := stackReadFallbacks()
+	if err := pprof.StartCPUProfile(io.Discard); err != nil {
+		t.Skipf("CPU profile already running: %v", err)
+	}
+	// Several threads at once, so that most aren't the main thread, whose
+	// bounds are cached at startup
+	const threads = 4
+	var wg sync.WaitGroup
+	cached := make([]bool, threads)
+	for i := 0; i < threads; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			runtime.LockOSThread()
+			defer runtime.UnlockOSThread()
+			cached[i] = threadStackBoundsCached()
+			for start := time.Now(); time.Since(start) < time.Second; {
+				internal.SpinC(12, 1<<20)
+			}
+		}(i)
+	}
+	wg.Wait()
+	pprof.StopCPUProfile()
+	afterFallback, afterFaults := stackReadFallbacks()
+
+	for i, ok := range cached {
+		if !ok {
+			t.Errorf("thread %d: stack bounds not cached", i)
+		}
+	}
+	// Each thread adds its count to the totals every 256 reads, so a few
+	// reads elsewhere may show up, but not a few per sample
+	t.Logf("%d fallback reads, %d faults", afterFallback-fallback, afterFaults-faults)
+	if afterFallback-fallback > 256 {
+		t.Errorf("%d stack reads outside the cached stack bounds during a profile of C code", afterFallback-fallback)
+	}
+}
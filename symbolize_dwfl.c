@@ -11,6 +11,7 @@
 
 #include <elfutils/libdwfl.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include "cgotraceback.h"
 
@@ -24,7 +25,7 @@ static const Dwfl_Callbacks dwfl_callbacks = {
 
 static int dl_callback(struct dl_phdr_info *info, size_t size, void *data);
 
-__attribute__ ((constructor)) static void init(void) {
+static void init_dwfl(void) {
         dwfl = dwfl_begin(&dwfl_callbacks);
         if (dwfl == NULL) {
                 return;
@@ -36,6 +37,61 @@ __attribute__ ((constructor)) static void init(void) {
         dwfl_report_end(dwfl, NULL, NULL);
 }
 
+#ifdef CGOTRACEBACK_BACKGROUND_INIT
+
+static pthread_cond_t dwfl_ready_cond = PTHREAD_COND_INITIALIZER;
+static int dwfl_ready = 0;
+
+static void set_dwfl_ready(void) {
+        pthread_mutex_lock(&dwfl_lock);
+        dwfl_ready = 1;
+        pthread_cond_broadcast(&dwfl_ready_cond);
+        pthread_mutex_unlock(&dwfl_lock);
+}
+
+// Called with dwfl_lock held
+static void wait_dwfl_ready(void) {
+        while (!dwfl_ready) {
+                pthread_cond_wait(&dwfl_ready_cond, &dwfl_lock);
+        }
+}
+
+static void *init_thread(void *arg) {
+        init_dwfl();
+        set_dwfl_ready();
+        return NULL;
+}
+
+__attribute__ ((constructor)) static void init(void) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        int err = pthread_create(&thread, &attr, init_thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0) {
+                init_dwfl();
+                set_dwfl_ready();
+        }
+}
+
+#else
+
+static void wait_dwfl_ready(void) {
+}
+
+__attribute__ ((constructor)) static void init(void) {
+        init_dwfl();
+}
+
+#endif // CGOTRACEBACK_BACKGROUND_INIT
+
 static char *full_readlink(const char *path) {
         char *p = NULL;
         size_t len = 128;
@@ -90,6 +146,9 @@ static int dl_callback(struct dl_phdr_info *info, size_t size, void *data) {
 
 void cgo_symbolizer(void *p) {
         pthread_mutex_lock(&dwfl_lock);
+        // Symbolization isn't done from signal handlers, so it's fine to
+        // wait for background initialization to finish
+        wait_dwfl_ready();
         if (dwfl == NULL) {
                 pthread_mutex_unlock(&dwfl_lock);
                 return;